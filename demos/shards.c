@@ -0,0 +1,277 @@
+/*
+ * shards: runs several lwp runtimes at once, one per OS thread.
+ *
+ * Each shard starts its own runtime with lwp_runtime_start_on_this_thread,
+ * creates a key of its own next to one shared by every shard, and runs half
+ * of its threads on private growable stacks and half on the shared stack.
+ * Every thread recurses deep enough to grow its stack, yields at the bottom
+ * (so shared stack threads get their frames saved on the switch path), then
+ * yields a number of times on its way out. Once its threads exist a shard
+ * posts to the next one with lwp_runtime_post. At the end the demo checks
+ * that every thread ran to completion, that the key destructors ran once per
+ * value, that no two shards were handed the same key, that every post
+ * arrived and that each runtime's stack watermarks only cover its own
+ * threads. It exits with 1 if anything is off.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lwp.h"
+
+#define SHARDS_MAX 64
+#define SHARD_STACK_INITIAL (16 * 1024)
+#define SHARD_STACK_MAX (256 * 1024)
+#define SHARD_FRAME_BYTES 1024
+#define SHARD_SLICE_NS 1000000ULL
+
+struct shard_config_st {
+    int shards;
+    int threads;
+    int yields;
+    int depth;
+};
+
+static struct shard_config_st shard_config = {
+    .shards = 4,
+    .threads = 200,
+    .yields = 100,
+    .depth = 32,
+};
+
+struct shard_st {
+    lwp_runtime rt;
+    pthread_t os_thread;
+    lwp_key_t key;
+    uint64_t moves;
+    uint64_t stack_samples;
+    atomic_int posts;
+    bool failed;
+};
+
+static struct shard_st shards[SHARDS_MAX];
+static lwp_key_t shard_common_key;
+static atomic_int shard_started;
+static atomic_long shard_dtor_runs;
+static volatile uint64_t shard_sink;
+
+static void shard_dtor(void *value) {
+    atomic_fetch_add(&shard_dtor_runs, 1);
+    free(value);
+}
+
+/**
+ * Touches `depth` frames of stack, yielding once at the bottom
+ */
+static uint64_t shard_recurse(int depth) {
+    volatile uint8_t frame[SHARD_FRAME_BYTES];
+    memset((void *)frame, depth, sizeof(frame));
+    if (depth == 0) {
+        lwp_yield();
+        return frame[0];
+    }
+    return shard_recurse(depth - 1) + frame[depth % SHARD_FRAME_BYTES];
+}
+
+static int shard_thread_main(void *arg) {
+    struct shard_st *shard = arg;
+    int *mine = calloc(1, sizeof(int));
+    int *common = calloc(1, sizeof(int));
+    int i;
+
+    if (mine == NULL || common == NULL) {
+        shard->failed = true;
+        free(mine);
+        free(common);
+        return 1;
+    }
+    // once set, a value is freed by the key's destructor
+    if (lwp_setspecific(shard->key, mine) == -1) {
+        free(mine);
+        free(common);
+        shard->failed = true;
+        return 1;
+    }
+    if (lwp_setspecific(shard_common_key, common) == -1) {
+        free(common);
+        shard->failed = true;
+        return 1;
+    }
+    shard_sink += shard_recurse(shard_config.depth);
+    for (i = 0; i < shard_config.yields; i++) {
+        shard->moves++;
+        lwp_yield();
+    }
+    if (lwp_getspecific(shard->key) != mine ||
+        lwp_getspecific(shard_common_key) != common) {
+        shard->failed = true;
+    }
+    return 0;
+}
+
+static int shard_post_main(void *arg) {
+    struct shard_st *shard = arg;
+    atomic_fetch_add(&shard->posts, 1);
+    return 0;
+}
+
+static void shard_count_samples(lwpfun entry, uint64_t peak,
+                                uint64_t samples, void *arg) {
+    struct shard_st *shard = arg;
+    (void)peak;
+    if (entry == shard_thread_main) {
+        shard->stack_samples += samples;
+    }
+}
+
+static void *shard_main(void *arg) {
+    struct shard_st *shard = arg;
+    int id = (int)(shard - shards);
+    struct shard_st *next = &shards[(id + 1) % shard_config.shards];
+    int i;
+
+    if (lwp_runtime_start_on_this_thread(shard->rt) == -1 ||
+        lwp_key_create(&shard->key, shard_dtor) == -1) {
+        shard->failed = true;
+        return NULL;
+    }
+    for (i = 0; i < shard_config.threads; i++) {
+        tid_t tid = i % 2 ? lwp_create_shared(shard_thread_main, shard)
+                          : lwp_create(shard_thread_main, shard);
+        if (tid == NO_THREAD) {
+            fprintf(stderr, "shards: shard %d failed to create a thread\n",
+                    id);
+            shard->failed = true;
+            return NULL;
+        }
+    }
+    // don't post until every runtime is running
+    atomic_fetch_add(&shard_started, 1);
+    while (atomic_load(&shard_started) < shard_config.shards) {
+        lwp_run_once();
+    }
+    if (lwp_runtime_post(next->rt, shard_post_main, next) == -1) {
+        shard->failed = true;
+    }
+    while (lwp_run_for(SHARD_SLICE_NS) > 0 ||
+           atomic_load(&shard->posts) == 0) {
+        if (atomic_load(&shard->posts) == 0) {
+            usleep(100);
+        }
+    }
+    // the post thread may still be a zombie, collect whatever is left
+    while (lwp_run_once() > 0) {
+    }
+    lwp_stack_usage_entries(shard_count_samples, shard);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-r runtimes] [-n threads] [-y yields] [-d depth]\n"
+            "  -r  runtimes to run at once, up to %d (default %d)\n"
+            "  -n  threads per runtime (default %d)\n"
+            "  -y  yields per thread (default %d)\n"
+            "  -d  frames of %d bytes each thread recurses into "
+            "(default %d)\n",
+            prog, SHARDS_MAX, shard_config.shards, shard_config.threads,
+            shard_config.yields, SHARD_FRAME_BYTES, shard_config.depth);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int i;
+    int j;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "r:n:y:d:")) != -1) {
+        switch (opt) {
+        case 'r':
+            shard_config.shards = atoi(optarg);
+            break;
+        case 'n':
+            shard_config.threads = atoi(optarg);
+            break;
+        case 'y':
+            shard_config.yields = atoi(optarg);
+            break;
+        case 'd':
+            shard_config.depth = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (shard_config.shards < 2 || shard_config.shards > SHARDS_MAX ||
+        shard_config.threads <= 0 || shard_config.yields < 0 ||
+        shard_config.depth < 0 ||
+        (uint64_t)(shard_config.depth + 4) * SHARD_FRAME_BYTES >
+            SHARD_STACK_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (lwp_set_stack_growth(SHARD_STACK_INITIAL, SHARD_STACK_MAX) == -1 ||
+        lwp_key_create(&shard_common_key, shard_dtor) == -1) {
+        fprintf(stderr, "shards: setup failed\n");
+        return 1;
+    }
+    lwp_set_stack_watermarks(true);
+    for (i = 0; i < shard_config.shards; i++) {
+        shards[i].rt = lwp_runtime_new();
+        if (shards[i].rt == NULL) {
+            fprintf(stderr, "shards: failed to make runtime %d\n", i);
+            return 1;
+        }
+    }
+    for (i = 0; i < shard_config.shards; i++) {
+        if (pthread_create(&shards[i].os_thread, NULL, shard_main,
+                           &shards[i]) != 0) {
+            fprintf(stderr, "shards: failed to start shard %d\n", i);
+            return 1;
+        }
+    }
+    for (i = 0; i < shard_config.shards; i++) {
+        pthread_join(shards[i].os_thread, NULL);
+    }
+
+    printf("%-6s %8s %10s %6s %6s %8s\n", "shard", "threads", "moves", "key",
+           "posts", "samples");
+    for (i = 0; i < shard_config.shards; i++) {
+        struct shard_st *shard = &shards[i];
+        printf("%-6d %8d %10lu %6u %6d %8lu\n", i, shard_config.threads,
+               (unsigned long)shard->moves, shard->key,
+               atomic_load(&shard->posts),
+               (unsigned long)shard->stack_samples);
+        if (shard->failed ||
+            shard->moves !=
+                (uint64_t)shard_config.threads * shard_config.yields ||
+            atomic_load(&shard->posts) != 1 ||
+            shard->stack_samples > (uint64_t)shard_config.threads) {
+            fprintf(stderr, "shards: shard %d went wrong\n", i);
+            ok = false;
+        }
+        for (j = 0; j < i; j++) {
+            if (shards[j].key == shard->key) {
+                fprintf(stderr, "shards: shards %d and %d share key %u\n", j,
+                        i, shard->key);
+                ok = false;
+            }
+        }
+    }
+    if (atomic_load(&shard_dtor_runs) !=
+        2L * shard_config.shards * shard_config.threads) {
+        fprintf(stderr, "shards: %ld key destructor runs, expected %ld\n",
+                atomic_load(&shard_dtor_runs),
+                2L * shard_config.shards * shard_config.threads);
+        ok = false;
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,478 @@
+/*
+ * snakesim: a headless load generator for comparing schedulers.
+ *
+ * Runs N snakes, one LWP each, on a virtual grid (a torus, one byte per
+ * cell) with no rendering. On every move a snake spins for the given number
+ * of iterations to stand in for real work, then tries to step its head into
+ * a free cell next to it and drops its tail. Snakes yield every few moves.
+ * Each installed scheduler gets a run of the same length. After each run
+ * the demo reports the moves per second and how fairly the moves were
+ * shared between the snakes (Jain's index, 1.0 when every snake moved
+ * equally often).
+ *
+ * The threads are created with lwp_create_many and driven with lwp_run_for.
+ * Stacks are growable when the kernel allows enough mappings for them (two
+ * per stack), otherwise they are made small by lowering the stack rlimit,
+ * which is what lwp sizes them by, so it scales to 100k snakes.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "lwp.h"
+
+#define SIM_MAX_SNAKES 100000
+#define SIM_SNAKE_LEN 4
+#define SIM_CELLS_PER_SNAKE 16
+#define SIM_STACK_INITIAL (16 * 1024)
+#define SIM_STACK_MAX (64 * 1024)
+#define SIM_STACK_FIXED (256 * 1024)
+#define SIM_MAP_COUNT_PATH "/proc/sys/vm/max_map_count"
+#define SIM_SLICE_NS 10000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+struct sim_snake_st {
+    // body cells as indexes into the grid, body[head] is the head
+    uint32_t body[SIM_SNAKE_LEN];
+    int head;
+    int dir;
+    uint32_t rng;
+    uint64_t moves;
+    uint64_t blocked;
+};
+
+struct sim_config_st {
+    int snakes;
+    long move_cost;
+    int yield_every;
+    double seconds;
+    int groups;
+    uint32_t side;
+};
+
+static struct sim_config_st sim_config = {
+    .snakes = 1000,
+    .move_cost = 100,
+    .yield_every = 1,
+    .seconds = 2.0,
+    .groups = 4,
+    .side = 0,
+};
+
+static uint8_t *sim_grid;
+static struct sim_snake_st *sim_snakes;
+static volatile bool sim_done;
+static volatile uint64_t sim_sink;
+
+static const int sim_dx[4] = {1, 0, -1, 0};
+static const int sim_dy[4] = {0, 1, 0, -1};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t sim_rand(struct sim_snake_st *s) {
+    // xorshift32, good enough to pick directions
+    uint32_t x = s->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s->rng = x;
+    return x;
+}
+
+static uint32_t sim_neighbour(uint32_t cell, int dir) {
+    uint32_t side = sim_config.side;
+    uint32_t x = cell % side;
+    uint32_t y = cell / side;
+    x = (x + side + sim_dx[dir]) % side;
+    y = (y + side + sim_dy[dir]) % side;
+    return y * side + x;
+}
+
+/**
+ * Burns `move_cost` iterations of arithmetic, the work done per move
+ */
+static void sim_work(struct sim_snake_st *s) {
+    uint64_t acc = s->rng;
+    long i;
+    for (i = 0; i < sim_config.move_cost; i++) {
+        acc = acc * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    sim_sink = acc;
+}
+
+/**
+ * Moves the snake one cell, keeping its direction most of the time. A snake
+ * boxed in by others stays put, which still counts as its move
+ */
+static void sim_move(struct sim_snake_st *s) {
+    uint32_t head = s->body[s->head];
+    int turn, i;
+
+    sim_work(s);
+    if (sim_rand(s) % 4 == 0) {
+        s->dir = (int)(sim_rand(s) % 4);
+    }
+    for (turn = 0; turn < 4; turn++) {
+        int dir = (s->dir + turn) % 4;
+        uint32_t next = sim_neighbour(head, dir);
+        if (sim_grid[next]) {
+            continue;
+        }
+        // the tail leaves its cell as the head takes the new one
+        i = (s->head + 1) % SIM_SNAKE_LEN;
+        sim_grid[s->body[i]] = 0;
+        sim_grid[next] = 1;
+        s->body[i] = next;
+        s->head = i;
+        s->dir = dir;
+        s->moves++;
+        return;
+    }
+    s->blocked++;
+    s->moves++;
+}
+
+static int sim_snake_main(void *arg) {
+    struct sim_snake_st *s = arg;
+    int since_yield = 0;
+
+    while (!sim_done) {
+        sim_move(s);
+        if (++since_yield >= sim_config.yield_every) {
+            since_yield = 0;
+            lwp_yield();
+        }
+    }
+    return 0;
+}
+
+/**
+ * Tries to lay the snake out in a straight line of free cells with its head
+ * on `cell`, facing its direction. Claims the cells and returns true if they
+ * were all free, leaves the grid as it was and returns false otherwise
+ */
+static bool sim_lay_out(struct sim_snake_st *s, uint32_t cell) {
+    int back = (s->dir + 2) % 4;
+    int j;
+
+    // body[head] is the head and the tail is the entry after it
+    s->head = SIM_SNAKE_LEN - 1;
+    for (j = SIM_SNAKE_LEN - 1; j >= 0; j--) {
+        if (sim_grid[cell]) {
+            while (++j < SIM_SNAKE_LEN) {
+                sim_grid[s->body[j]] = 0;
+            }
+            return false;
+        }
+        sim_grid[cell] = 1;
+        s->body[j] = cell;
+        cell = sim_neighbour(cell, back);
+    }
+    return true;
+}
+
+/**
+ * Places every snake in a line of free cells. Returns -1 if the grid is too
+ * full
+ */
+static int sim_place(int n) {
+    uint64_t cells = (uint64_t)sim_config.side * sim_config.side;
+    uint32_t seed = 0x9e3779b9u;
+    int i;
+
+    memset(sim_grid, 0, cells);
+    memset(sim_snakes, 0, n * sizeof(struct sim_snake_st));
+    for (i = 0; i < n; i++) {
+        struct sim_snake_st *s = &sim_snakes[i];
+        uint64_t tries;
+        bool placed = false;
+
+        s->rng = seed + (uint32_t)i * 2654435761u;
+        if (s->rng == 0) {
+            s->rng = 1;
+        }
+        for (tries = 0; tries < cells && !placed; tries++) {
+            s->dir = (int)(sim_rand(s) % 4);
+            placed = sim_lay_out(s, sim_rand(s) % cells);
+        }
+        if (!placed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Jain's fairness index of the snakes' moves: (sum x)^2 / (n * sum x^2)
+ */
+static double sim_fairness(int n) {
+    double sum = 0, sum_sq = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        double x = (double)sim_snakes[i].moves;
+        sum += x;
+        sum_sq += x * x;
+    }
+    if (sum_sq == 0) {
+        return 0;
+    }
+    return sum * sum / (n * sum_sq);
+}
+
+/**
+ * Runs the snakes under the current scheduler for the configured time and
+ * prints a line of results. `groups` > 0 spreads the snakes over that many
+ * equally weighted groups of the group scheduler
+ */
+static int sim_run(const char *name, int groups) {
+    int n = sim_config.snakes;
+    void **args;
+    tid_t *tids;
+    lwp_group *group_list = NULL;
+    uint64_t start, elapsed, limit, total = 0, blocked = 0, min, max;
+    int i;
+
+    if (sim_place(n) == -1) {
+        fprintf(stderr, "snakesim: grid is too small for %d snakes\n", n);
+        return -1;
+    }
+    args = malloc(n * sizeof(void *));
+    tids = malloc(n * sizeof(tid_t));
+    if (args == NULL || tids == NULL) {
+        fprintf(stderr, "snakesim: failed to allocate thread arguments\n");
+        free(args);
+        free(tids);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        args[i] = &sim_snakes[i];
+    }
+    if (groups > 0) {
+        group_list = malloc(groups * sizeof(lwp_group));
+        if (group_list == NULL) {
+            fprintf(stderr, "snakesim: failed to allocate group list\n");
+            free(args);
+            free(tids);
+            return -1;
+        }
+        for (i = 0; i < groups; i++) {
+            group_list[i] = lwp_group_create(1, NULL);
+            if (group_list[i] == NULL) {
+                fprintf(stderr, "snakesim: failed to create group %d\n", i);
+                free(group_list);
+                free(args);
+                free(tids);
+                return -1;
+            }
+        }
+    }
+    sim_done = false;
+    if (lwp_create_many(sim_snake_main, args, n, tids) != n) {
+        fprintf(stderr, "snakesim: failed to create %d snakes\n", n);
+        free(group_list);
+        free(args);
+        free(tids);
+        return -1;
+    }
+    for (i = 0; group_list != NULL && i < n; i++) {
+        if (lwp_group_add(group_list[i % groups], tids[i]) == -1) {
+            fprintf(stderr, "snakesim: failed to add snake %d to a group\n",
+                    i);
+            // the snakes exit as soon as they run
+            sim_done = true;
+            while (lwp_run_once() > 0) {
+            }
+            free(group_list);
+            free(args);
+            free(tids);
+            return -1;
+        }
+    }
+
+    limit = (uint64_t)(sim_config.seconds * NS_PER_SEC);
+    start = now_ns();
+    elapsed = 0;
+    while (elapsed < limit) {
+        uint64_t slice = limit - elapsed;
+        lwp_run_for(slice < SIM_SLICE_NS ? slice : SIM_SLICE_NS);
+        elapsed = now_ns() - start;
+    }
+    sim_done = true;
+    // let every snake see `sim_done` and exit
+    while (lwp_run_once() > 0) {
+    }
+
+    min = max = sim_snakes[0].moves;
+    for (i = 0; i < n; i++) {
+        uint64_t m = sim_snakes[i].moves;
+        total += m;
+        blocked += sim_snakes[i].blocked;
+        if (m < min) {
+            min = m;
+        }
+        if (m > max) {
+            max = m;
+        }
+    }
+    printf("%-8s %8d %12.0f %10.4f %10lu %10lu %8.2f%%\n", name, n,
+           total / ((double)elapsed / NS_PER_SEC), sim_fairness(n), min, max,
+           total == 0 ? 0.0 : 100.0 * blocked / total);
+    fflush(stdout);
+    free(group_list);
+    free(args);
+    free(tids);
+    return 0;
+}
+
+/**
+ * Sets up the snakes' stacks, see the top of the file. Returns a description
+ * of them or NULL on failure
+ */
+static const char *sim_setup_stacks(int n) {
+    FILE *f = fopen(SIM_MAP_COUNT_PATH, "r");
+    long max_maps = 0;
+    struct rlimit rlim;
+
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &max_maps) != 1) {
+            max_maps = 0;
+        }
+        fclose(f);
+    }
+    // leave room for the mappings the rest of the process has
+    if ((long)n * 2 + 1024 < max_maps) {
+        if (lwp_set_stack_growth(SIM_STACK_INITIAL, SIM_STACK_MAX) == -1) {
+            return NULL;
+        }
+        return "growable stacks";
+    }
+    if (getrlimit(RLIMIT_STACK, &rlim) == -1) {
+        return NULL;
+    }
+    if (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > SIM_STACK_FIXED) {
+        rlim.rlim_cur = SIM_STACK_FIXED;
+        if (setrlimit(RLIMIT_STACK, &rlim) == -1) {
+            return NULL;
+        }
+    }
+    return "fixed stacks";
+}
+
+/**
+ * Whether the installed scheduler is the group scheduler, the only other one
+ * being rr
+ */
+static bool sim_sched_is_group(void) {
+    return lwp_get_scheduler()->next == lwp_group_scheduler()->next;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n snakes] [-c move_cost] [-y yield_every] "
+            "[-t seconds] [-g groups] [-s grid_side] [-h]\n"
+            "  -n  number of snakes, up to %d (default %d)\n"
+            "  -c  iterations of work per move (default %ld)\n"
+            "  -y  moves between yields (default %d)\n"
+            "  -t  seconds to run each scheduler for (default %.1f)\n"
+            "  -g  groups to spread the snakes over for the group "
+            "scheduler (default %d)\n"
+            "  -s  side of the square grid (default fits %d cells per "
+            "snake)\n"
+            "  -h  print this and exit\n",
+            prog, SIM_MAX_SNAKES, sim_config.snakes, sim_config.move_cost,
+            sim_config.yield_every, sim_config.seconds, sim_config.groups,
+            SIM_CELLS_PER_SNAKE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    uint64_t cells;
+    const char *stacks;
+
+    while ((opt = getopt(argc, argv, "n:c:y:t:g:s:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            sim_config.snakes = atoi(optarg);
+            break;
+        case 'c':
+            sim_config.move_cost = atol(optarg);
+            break;
+        case 'y':
+            sim_config.yield_every = atoi(optarg);
+            break;
+        case 't':
+            sim_config.seconds = atof(optarg);
+            break;
+        case 'g':
+            sim_config.groups = atoi(optarg);
+            break;
+        case 's':
+            sim_config.side = (uint32_t)atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (sim_config.snakes <= 0 || sim_config.snakes > SIM_MAX_SNAKES ||
+        sim_config.move_cost < 0 || sim_config.yield_every <= 0 ||
+        sim_config.seconds <= 0 || sim_config.groups <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (sim_config.side == 0) {
+        sim_config.side = 1;
+        while ((uint64_t)sim_config.side * sim_config.side <
+               (uint64_t)sim_config.snakes * SIM_CELLS_PER_SNAKE) {
+            sim_config.side++;
+        }
+    }
+    cells = (uint64_t)sim_config.side * sim_config.side;
+    sim_grid = malloc(cells);
+    sim_snakes = malloc(sim_config.snakes * sizeof(struct sim_snake_st));
+    if (sim_grid == NULL || sim_snakes == NULL) {
+        fprintf(stderr, "snakesim: failed to allocate the grid\n");
+        return 1;
+    }
+    stacks = sim_setup_stacks(sim_config.snakes);
+    if (stacks == NULL) {
+        fprintf(stderr, "snakesim: failed to set up the stacks\n");
+        return 1;
+    }
+
+    printf("%d snakes on a %ux%u grid, move cost %ld, yield every %d "
+           "moves, %.1fs per scheduler, %s\n",
+           sim_config.snakes, sim_config.side, sim_config.side,
+           sim_config.move_cost, sim_config.yield_every, sim_config.seconds,
+           stacks);
+    printf("%-8s %8s %12s %10s %10s %10s %9s\n", "sched", "snakes",
+           "moves/sec", "fairness", "min", "max", "blocked");
+
+    // the default is rr unless lwp was built with another scheduler bound
+    // (LWP_STATIC_SCHED), which can't be replaced either
+    lwp_set_scheduler(NULL);
+    if (sim_sched_is_group()) {
+        fprintf(stderr, "snakesim: rr is not available in this build\n");
+    } else if (sim_run("rr", 0) == -1) {
+        return 1;
+    }
+    lwp_set_scheduler(lwp_group_scheduler());
+    if (!sim_sched_is_group()) {
+        fprintf(stderr, "snakesim: group is not available in this build\n");
+    } else if (sim_run("group", sim_config.groups) == -1) {
+        return 1;
+    }
+    return 0;
+}
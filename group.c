@@ -0,0 +1,413 @@
+#ifndef GROUP_SCHED
+
+#define GROUP_SCHED
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lwp.h"
+#include "rr.c"
+
+/*
+ * Scheduler that shares the CPU between groups of threads in proportion to
+ * their weights, then picks a thread inside the chosen group with the
+ * group's own scheduler (or a round robin ring if it has none).
+ *
+ * Each group has a virtual runtime that grows by the cycles its threads run
+ * divided by its weight, and `group_next` picks the group with the smallest
+ * one that has a ready thread. A group that had nothing ready is moved up to
+ * the smallest virtual runtime of the others when it gets a thread again, so
+ * it can't make up for time it did not want the CPU
+ */
+
+#define GROUP_WEIGHT_SCALE 1024
+#define GROUPS_INITIAL_CAP 8
+#define GROUP_MEMBERS_INITIAL_CAP 64
+
+struct lwp_group_st {
+    unsigned int weight;
+    scheduler inner;            /* NULL to use `ring` */
+    struct rr_ring_st ring;
+    uint64_t vruntime;          /* weighted cycles run */
+    uint64_t switches;
+    uint64_t run_cycles;
+};
+
+/* the group of each thread by tid and whether it is in the pool */
+struct group_member_st {
+    lwp_group group;            /* NULL for `group_default` */
+    bool queued;
+};
+
+struct __group_globals_st {
+    lwp_group *groups;
+    uint64_t len;
+    uint64_t cap;
+    struct group_member_st *members;
+    uint64_t members_cap;
+    // the group of threads that were not added to one
+    struct lwp_group_st dflt;
+};
+
+#define GROUP_GLOBALS_INITIALIZER \
+    {.groups = NULL, .len = 0, .dflt = {.weight = 1, .inner = NULL}}
+
+/*
+ * Like rr.c's `RR_RING`, lwp.c makes this the current runtime's state
+ */
+#ifndef GROUP_GLOBALS
+static struct __group_globals_st __group_globals = GROUP_GLOBALS_INITIALIZER;
+#define GROUP_GLOBALS (&__group_globals)
+#endif
+#define group_default (GROUP_GLOBALS->dflt)
+
+/**
+ * Returns the membership entry of the thread, growing the table if needed,
+ * or NULL if it could not be grown
+ */
+static struct group_member_st *group_membership(thread t) {
+    if (t->tid >= GROUP_GLOBALS->members_cap) {
+        uint64_t new_cap = GROUP_GLOBALS->members_cap == 0
+                               ? GROUP_MEMBERS_INITIAL_CAP
+                               : GROUP_GLOBALS->members_cap;
+        while (new_cap <= t->tid) {
+            new_cap *= 2;
+        }
+        struct group_member_st *tmp = realloc(
+            GROUP_GLOBALS->members, new_cap * sizeof(struct group_member_st));
+        if (tmp == NULL) {
+            fprintf(stderr, "lwp_group: failed to grow member table\n");
+            return NULL;
+        }
+        memset(tmp + GROUP_GLOBALS->members_cap, 0,
+               (new_cap - GROUP_GLOBALS->members_cap) *
+                   sizeof(struct group_member_st));
+        GROUP_GLOBALS->members = tmp;
+        GROUP_GLOBALS->members_cap = new_cap;
+    }
+    return &GROUP_GLOBALS->members[t->tid];
+}
+
+static lwp_group group_of(thread t) {
+    if (t->tid < GROUP_GLOBALS->members_cap &&
+        GROUP_GLOBALS->members[t->tid].group != NULL) {
+        return GROUP_GLOBALS->members[t->tid].group;
+    }
+    return &group_default;
+}
+
+static int group_add_group(lwp_group g) {
+    if (GROUP_GLOBALS->len == GROUP_GLOBALS->cap) {
+        uint64_t new_cap = GROUP_GLOBALS->cap == 0 ? GROUPS_INITIAL_CAP
+                                                    : GROUP_GLOBALS->cap * 2;
+        lwp_group *tmp =
+            realloc(GROUP_GLOBALS->groups, new_cap * sizeof(lwp_group));
+        if (tmp == NULL) {
+            return -1;
+        }
+        GROUP_GLOBALS->groups = tmp;
+        GROUP_GLOBALS->cap = new_cap;
+    }
+    GROUP_GLOBALS->groups[GROUP_GLOBALS->len++] = g;
+    return 0;
+}
+
+static int group_ready(lwp_group g) {
+    if (g->inner != NULL) {
+        return g->inner->qlen();
+    }
+    return (int)g->ring.len;
+}
+
+/**
+ * Brings a group that is about to have a ready thread again up to the
+ * smallest virtual runtime among the groups that have ready threads
+ */
+static void group_catch_up(lwp_group g) {
+    uint64_t i;
+    bool found = false;
+    uint64_t min = 0;
+
+    for (i = 0; i < GROUP_GLOBALS->len; i++) {
+        lwp_group other = GROUP_GLOBALS->groups[i];
+        if (other == g || group_ready(other) == 0) {
+            continue;
+        }
+        if (!found || other->vruntime < min) {
+            min = other->vruntime;
+            found = true;
+        }
+    }
+    if (found && g->vruntime < min) {
+        g->vruntime = min;
+    }
+}
+
+static void group_inner_admit(lwp_group g, thread t, bool wake) {
+    if (group_ready(g) == 0) {
+        group_catch_up(g);
+    }
+    if (g->inner == NULL) {
+        rr_ring_admit(&g->ring, t);
+    } else if (wake && g->inner->version >= LWP_SCHED_VERSION &&
+               g->inner->on_wake != NULL) {
+        g->inner->on_wake(t);
+    } else {
+        g->inner->admit(t);
+    }
+}
+
+static void group_inner_remove(lwp_group g, thread t) {
+    if (g->inner == NULL) {
+        rr_ring_remove(&g->ring, t);
+    } else {
+        g->inner->remove(t);
+    }
+}
+
+static void group_init(void) {
+    if (GROUP_GLOBALS->len == 0) {
+        group_add_group(&group_default);
+    }
+}
+
+static void group_shutdown(void) {
+    uint64_t i;
+    for (i = 0; i < GROUP_GLOBALS->len; i++) {
+        if (GROUP_GLOBALS->groups[i]->inner == NULL) {
+            rr_ring_clear(&GROUP_GLOBALS->groups[i]->ring);
+        }
+    }
+    for (i = 0; i < GROUP_GLOBALS->members_cap; i++) {
+        GROUP_GLOBALS->members[i].queued = false;
+    }
+}
+
+static void group_admit(thread t) {
+    struct group_member_st *m = group_membership(t);
+    if (m == NULL) {
+        // still schedule it, without remembering it is queued
+        group_inner_admit(&group_default, t, false);
+        return;
+    }
+    m->queued = true;
+    group_inner_admit(group_of(t), t, false);
+}
+
+static void group_remove(thread t) {
+    struct group_member_st *m = group_membership(t);
+    if (m != NULL) {
+        m->queued = false;
+    }
+    group_inner_remove(group_of(t), t);
+}
+
+static thread group_next(void) {
+    uint64_t i;
+    lwp_group best = NULL;
+
+    for (i = 0; i < GROUP_GLOBALS->len; i++) {
+        lwp_group g = GROUP_GLOBALS->groups[i];
+        if (group_ready(g) == 0) {
+            continue;
+        }
+        if (best == NULL || g->vruntime < best->vruntime) {
+            best = g;
+        }
+    }
+    if (best == NULL) {
+        return NULL;
+    }
+    if (best->inner == NULL) {
+        return rr_ring_next(&best->ring);
+    }
+    return best->inner->next();
+}
+
+static int group_qlen(void) {
+    uint64_t i;
+    int qlen = 0;
+    for (i = 0; i < GROUP_GLOBALS->len; i++) {
+        qlen += group_ready(GROUP_GLOBALS->groups[i]);
+    }
+    return qlen;
+}
+
+static void group_on_block(thread t) {
+    lwp_group g = group_of(t);
+    struct group_member_st *m = group_membership(t);
+    if (m != NULL) {
+        m->queued = false;
+    }
+    if (g->inner != NULL && g->inner->version >= LWP_SCHED_VERSION &&
+        g->inner->on_block != NULL) {
+        g->inner->on_block(t);
+        return;
+    }
+    group_inner_remove(g, t);
+}
+
+static void group_on_wake(thread t) {
+    struct group_member_st *m = group_membership(t);
+    if (m != NULL) {
+        m->queued = true;
+    }
+    group_inner_admit(group_of(t), t, true);
+}
+
+static void group_on_exit(thread t) {
+    lwp_group g = group_of(t);
+    struct group_member_st *m = group_membership(t);
+    if (g->inner == NULL) {
+        rr_ring_remove(&g->ring, t);
+    } else if (g->inner->version >= LWP_SCHED_VERSION) {
+        if (g->inner->on_exit != NULL) {
+            g->inner->on_exit(t);
+        } else {
+            g->inner->remove(t);
+        }
+    }
+    if (m != NULL) {
+        // the tid may be reused by a thread that is not in the group
+        m->queued = false;
+        m->group = NULL;
+    }
+}
+
+static void group_on_yield(thread t, unsigned long long ran_cycles) {
+    lwp_group g = group_of(t);
+    g->switches++;
+    g->run_cycles += ran_cycles;
+    g->vruntime += ran_cycles * GROUP_WEIGHT_SCALE / g->weight;
+    if (g->inner != NULL && g->inner->version >= LWP_SCHED_VERSION &&
+        g->inner->on_yield != NULL) {
+        g->inner->on_yield(t, ran_cycles);
+    }
+}
+
+static int group_drain(thread *out, int max) {
+    uint64_t i;
+    int n = 0;
+
+    for (i = 0; i < GROUP_GLOBALS->len && n < max; i++) {
+        lwp_group g = GROUP_GLOBALS->groups[i];
+        thread t;
+        while (n < max) {
+            if (g->inner == NULL) {
+                t = rr_ring_next(&g->ring);
+            } else {
+                t = g->inner->next();
+            }
+            if (t == NULL) {
+                break;
+            }
+            group_remove(t);
+            out[n++] = t;
+        }
+    }
+    return n;
+}
+
+/* for binding it at compile time, see LWP_STATIC_SCHED in lwp.c */
+#define group_HAS_ADMIT_BATCH 0
+#define group_HAS_ON_YIELD 1
+
+static struct scheduler_st group_scheduler = {
+    .init = group_init,
+    .shutdown = group_shutdown,
+    .admit = group_admit,
+    .remove = group_remove,
+    .next = group_next,
+    .qlen = group_qlen,
+    .version = LWP_SCHED_VERSION,
+    .on_block = group_on_block,
+    .on_wake = group_on_wake,
+    .on_exit = group_on_exit,
+    .on_yield = group_on_yield,
+    .drain = group_drain,
+};
+
+scheduler lwp_group_scheduler(void) {
+    return &group_scheduler;
+}
+
+lwp_group lwp_group_create(unsigned int weight, scheduler inner) {
+    if (weight == 0) {
+        fprintf(stderr, "lwp_group_create: weight must be positive\n");
+        return NULL;
+    }
+    lwp_group g = calloc(1, sizeof(struct lwp_group_st));
+    if (g == NULL) {
+        fprintf(stderr, "lwp_group_create: failed to allocate group\n");
+        return NULL;
+    }
+    g->weight = weight;
+    g->inner = inner;
+    group_init();
+    if (group_add_group(g) == -1) {
+        fprintf(stderr, "lwp_group_create: failed to grow group list\n");
+        free(g);
+        return NULL;
+    }
+    if (inner != NULL && inner->init != NULL) {
+        inner->init();
+    }
+    return g;
+}
+
+int lwp_group_add(lwp_group g, tid_t tid) {
+    thread t = tid2thread(tid);
+    // unused slots (never created or already freed) have a tid of NO_THREAD
+    if (t == NULL || t->tid != tid || LWPTERMINATED(t->status)) {
+        fprintf(stderr, "lwp_group_add: no thread %lu\n", tid);
+        return -1;
+    }
+    struct group_member_st *m = group_membership(t);
+    if (m == NULL) {
+        return -1;
+    }
+    lwp_group old = group_of(t);
+    if (g == NULL) {
+        g = &group_default;
+    }
+    if (old == g) {
+        return 0;
+    }
+    if (m->queued) {
+        group_inner_remove(old, t);
+        m->group = g == &group_default ? NULL : g;
+        group_inner_admit(g, t, false);
+    } else {
+        m->group = g == &group_default ? NULL : g;
+    }
+    return 0;
+}
+
+int lwp_group_set_weight(lwp_group g, unsigned int weight) {
+    if (weight == 0) {
+        return -1;
+    }
+    if (g == NULL) {
+        g = &group_default;
+    }
+    g->weight = weight;
+    return 0;
+}
+
+int lwp_group_stats(lwp_group g, struct lwp_group_stats_st *out) {
+    if (out == NULL) {
+        return -1;
+    }
+    if (g == NULL) {
+        g = &group_default;
+    }
+    out->weight = g->weight;
+    out->ready = group_ready(g);
+    out->switches = g->switches;
+    out->run_cycles = g->run_cycles;
+    return 0;
+}
+
+#endif
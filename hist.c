@@ -0,0 +1,94 @@
+#ifndef LWP_HIST
+
+#define LWP_HIST
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwp.h"
+
+/*
+ * HDR style log-linear histogram.
+ * Values below 2 * HIST_SUB_COUNT get a bucket each, above that every power
+ * of two range is split into HIST_SUB_COUNT linear sub buckets, so the
+ * recorded value is never off by more than 1 / HIST_SUB_COUNT (~3%)
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct lwp_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_NUM_BUCKETS];
+};
+
+static inline int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (int)((v >> shift) - HIST_SUB_COUNT);
+}
+
+/**
+ * Returns the largest value that is recorded in the bucket at index i
+ */
+static uint64_t hist_bucket_max(int i) {
+    if (i < 2 * HIST_SUB_COUNT) {
+        return (uint64_t)i;
+    }
+    int shift = i / HIST_SUB_COUNT - 1;
+    uint64_t sub = (uint64_t)(i % HIST_SUB_COUNT + HIST_SUB_COUNT);
+    return (sub << shift) + ((1ULL << shift) - 1);
+}
+
+struct lwp_hist *lwp_hist_new(void) {
+    return (struct lwp_hist *)calloc(1, sizeof(struct lwp_hist));
+}
+
+void lwp_hist_free(struct lwp_hist *h) {
+    free(h);
+}
+
+void lwp_hist_reset(struct lwp_hist *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static inline void lwp_hist_record(struct lwp_hist *h, uint64_t v) {
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+/**
+ * Returns the value below which the given fraction (0.0 - 1.0) of the recorded
+ * values fall, or 0 if nothing has been recorded
+ */
+uint64_t lwp_hist_percentile(const struct lwp_hist *h, double fraction) {
+    int i;
+    uint64_t seen = 0;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(fraction * h->count + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t v = hist_bucket_max(i);
+            // the top bucket may be wider than anything actually recorded
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
@@ -1,26 +1,501 @@
+// for REG_RIP, dladdr and gettid
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 
 #include "lwp.h"
+#include "lwpstat.h"
+
+/* the schedulers keep their state in the current runtime */
+struct rr_ring_st;
+struct __group_globals_st;
+static inline struct rr_ring_st *runtime_rr_ring(void);
+static inline struct __group_globals_st *runtime_group_globals(void);
+#define RR_RING (runtime_rr_ring())
+#define GROUP_GLOBALS (runtime_group_globals())
+
 #include "rr.c"
+#include "group.c"
+#include "hist.c"
 
 #define MB (1 << 20)
 #define DEFAULT_STACK_SIZE (8 * MB)
 
 #define MAX_THREADS (UINT64_MAX - 1)
-/* arbitrary number of threads to allocate space for initially */
-#define DEFAULT_NUM_THREADS 32
-
-static struct scheduler_st lwp_current_scheduler;
-static scheduler lwp_current_scheduler_ptr = NULL;
-static thread_context *lwp_threads = NULL;
-static uint64_t lwp_num_threads = 0;
-static tid_t lwp_cur_tid = NO_THREAD;
+/* threads are allocated a page at a time and never move once allocated, as
+ * schedulers hold on to pointers to them */
+#define THREADS_PER_PAGE 256
+
+
+/*
+ * Building with -DLWP_STATIC_SCHED=<name> binds lwp to the scheduler
+ * `<name>_scheduler` (rr or group) at compile time: the pool operations and
+ * event hooks call `<name>_admit`, `<name>_next`, `<name>_on_block`, ...
+ * directly, so they can be inlined instead of going through the
+ * `scheduler_st` pointers, and `lwp_set_scheduler` only accepts that
+ * scheduler. Each scheduler file says which optional functions it has with
+ * `<name>_HAS_ADMIT_BATCH` and `<name>_HAS_ON_YIELD`. Without it the
+ * scheduler is picked at runtime as usual
+ */
+#ifdef LWP_STATIC_SCHED
+#define SCHED_PASTE2(a, b) a##_##b
+#define SCHED_PASTE(a, b) SCHED_PASTE2(a, b)
+#define SCHED_FN(fn) SCHED_PASTE(LWP_STATIC_SCHED, fn)
+// only valid once a thread exists, `lwp_get_scheduler` has run init by then
+#define sched_current() (&lwp_rt->current_scheduler)
+#define sched_admit(s, t) ((void)(s), SCHED_FN(admit)(t))
+#define sched_remove(s, t) ((void)(s), SCHED_FN(remove)(t))
+#define sched_next(s) ((void)(s), SCHED_FN(next)())
+#define sched_qlen(s) ((void)(s), SCHED_FN(qlen)())
+#else
+#define sched_current() lwp_get_scheduler()
+#define sched_admit(s, t) ((s)->admit(t))
+#define sched_remove(s, t) ((s)->remove(t))
+#define sched_next(s) ((s)->next())
+#define sched_qlen(s) ((s)->qlen())
+#endif
+/*
+ * admission control (see lwp_set_limits). 0 means no limit. Threads waiting
+ * for capacity under LWP_LIMIT_WAIT are queued on `admission_waiters`
+ * and woken one at a time as threads exit and their stacks are freed
+ */
+struct admission_waiter_st {
+    struct admission_waiter_st *next;
+    thread t;
+    bool queued;
+};
+
+/* shared memory stats region, NULL unless publishing the stats of
+ * `lwp_shm_rt` */
+static struct lwpstat_region *lwp_shm_region = NULL;
+static lwp_runtime lwp_shm_rt = NULL;
+static char lwp_shm_name[32];
+static uint64_t lwp_shm_interval_cycles = 0;
+static uint64_t lwp_shm_last_tsc = 0;
+static uint64_t lwp_shm_last_ns = 0;
+static uint64_t lwp_shm_last_switches = 0;
+#define SHM_STATS_ENV "LWP_STATS_SHM"
+
+/* if non zero new stacks start with this many bytes accessible and grow on
+ * demand up to `lwp_stack_max` bytes */
+static size_t lwp_stack_initial = 0;
+static size_t lwp_stack_max = 0;
+/* the handler runs on an alternate stack, which is per OS thread */
+static __thread stack_t lwp_sigaltstack = {.ss_sp = NULL};
+/* the handler itself is process wide and installed once */
+static pthread_once_t lwp_segv_once = PTHREAD_ONCE_INIT;
+static int lwp_segv_install_error = 0;
+static struct sigaction lwp_prev_segv_action;
+#define STACK_GUARD_SIZE (getpagesize())
+
+/*
+ * Shared stack mode: threads created with lwp_create_shared() all run on
+ * `shared_stack`. Only one of them (`shared_owner`) has its frames on
+ * the stack at a time, the others keep the live part of their stack (from
+ * their saved %rsp to the top) in a save buffer until they are next run
+ */
+#define SWITCHER_STACK_SIZE (64 * 1024)
+/* entry functions whose threads save more than this on average get a
+ * private stack from lwp_create_shared() */
+static size_t lwp_shared_promote_depth = 16 * 1024;
+
+/*
+ * Stackless tasks queued by lwp_spawn_task(), a ring buffer of `cap` entries
+ * starting at `head`. They are run on the yielding thread's stack at the start
+ * of lwp_yield()
+ */
+struct task_st {
+    lwpfun fun;
+    void *arg;
+};
+#define TASKS_INITIAL_CAP 64
+
+/*
+ * how many cycles a thread may run after it was dispatched before
+ * lwp_maybe_yield yields. A quantum of 0 means it has not been calibrated yet
+ * (see lwp_maybe_yield)
+ */
+static uint64_t lwp_quantum_cycles = 0;
+#define DEFAULT_QUANTUM_NS (1000 * 1000)
+
+/*
+ * the watchdog (see lwp_watchdog_start) is a pthread that samples `cur_tid`
+ * and `dispatch_tsc` of `lwp_watchdog_rt`. When a thread has been running for
+ * longer than `lwp_watchdog_cycles` it sends LWP_WATCHDOG_SIGNAL to the OS
+ * thread running that runtime, `lwp_watchdog_target`, whose handler reports
+ * the thread with a backtrace of where it is. `idle` is set while the
+ * runtime sleeps waiting for wake-ups, which is not the thread hogging
+ */
+#define LWP_WATCHDOG_SIGNAL SIGURG
+#define WATCHDOG_BACKTRACE_DEPTH 32
+static pthread_t lwp_watchdog_thread;
+static pthread_t lwp_watchdog_target;
+static lwp_runtime lwp_watchdog_rt = NULL;
+static volatile bool lwp_watchdog_running = false;
+static uint64_t lwp_watchdog_cycles = 0;
+static uint64_t lwp_watchdog_interval_ns = 0;
+/* what the watchdog saw when it sent the signal */
+static volatile tid_t lwp_watchdog_tid = NO_THREAD;
+static volatile uint64_t lwp_watchdog_dispatch = 0;
+/* how long it had been running then, worked out by the watchdog since the
+ * handler can't do floating point math */
+static volatile uint64_t lwp_watchdog_ran_us = 0;
+static uint64_t lwp_watchdog_events = 0;
+
+/*
+ * sampling profiler (see lwp_profile_start). A CPU time timer of the OS
+ * thread running the threads sends SIGPROF, whose handler walks the frame
+ * pointers of whatever was interrupted into the next slot of
+ * `lwp_profile_samples`. The handler is the only writer of `_head` and
+ * lwp_profile_write_folded the only writer of `_tail`, so the ring needs no
+ * lock, samples are dropped when it is full
+ */
+#define PROFILE_DEPTH 32
+struct profile_sample_st {
+    tid_t tid;
+    lwpfun entry;
+    uint32_t depth;
+    uintptr_t pcs[PROFILE_DEPTH];   /* innermost first */
+};
+static struct profile_sample_st *lwp_profile_samples = NULL;
+static uint64_t lwp_profile_cap = 0;
+static _Atomic uint64_t lwp_profile_head = 0;
+static _Atomic uint64_t lwp_profile_tail = 0;
+static uint64_t lwp_profile_taken = 0;
+static uint64_t lwp_profile_dropped = 0;
+static timer_t lwp_profile_timer;
+static bool lwp_profiling = false;
+/* bounds of the profiled OS thread's own stack, which the host (and the
+ * thread lwp_start made of it) runs on */
+static uintptr_t lwp_profile_host_low = 0;
+static uintptr_t lwp_profile_host_high = 0;
+
+/*
+ * wake-ups and posts from other OS threads (lwp_wake_external, lwp_post). A
+ * Vyukov MPSC queue: producers swap themselves in as `inbox_tail` and
+ * link the previous tail to them, the runtime pops from `inbox_head`, the
+ * last node it consumed. Producers set `inbox_signaled` after pushing so
+ * the runtime only checks a flag when switching, and only the one that sets
+ * it writes the eventfd
+ */
+struct inbox_node_st {
+    _Atomic(struct inbox_node_st *) next;
+    tid_t tid;              /* thread to wake or NO_THREAD for a post */
+    lwpfun fun;
+    void *arg;
+};
+
+/*
+ * a thread parked in lwp_await or lwp_await_any, linked into the waiters of
+ * the future(s) it is waiting on. Lives on the waiting thread's stack
+ */
+struct future_waiter_st {
+    struct future_waiter_st *prev;
+    struct future_waiter_st *next;
+    thread t;
+};
+/*
+ * a lwp_parallel_for call. The range is cut into `nchunks` chunks of `grain`
+ * indices, `pending` of which have not run yet. A task covering chunks
+ * [lo, hi) gets `tasks[lo]` as its argument, which is unique since splitting
+ * keeps the lower half and spawns the upper one
+ */
+struct parfor_st {
+    long begin;
+    long end;
+    long grain;
+    lwp_range_fun body;
+    void *ctx;
+    long pending;
+    thread waiter;          /* thread parked until pending is 0 */
+    struct parfor_task_st {
+        struct parfor_st *pf;
+        long lo;
+        long hi;
+    } *tasks;
+};
+
+struct lwp_future_st {
+    tid_t tid;              /* thread computing the result */
+    bool done;
+    int result;
+    struct future_waiter_st *waiters;
+};
+
+/*
+ * lwp_alloc() arenas are made of `ARENA_CHUNK_SIZE` chunks shared between the
+ * threads of a runtime through its `arena_pool`, a free list of at most
+ * `ARENA_POOL_MAX` chunks. Allocations too big for a chunk get a chunk of
+ * their own which is freed rather than pooled
+ */
+struct arena_chunk_st {
+    struct arena_chunk_st *next;
+    size_t size;            /* usable bytes after the header */
+};
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER_SIZE \
+    ((sizeof(struct arena_chunk_st) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_POOL_MAX 1024
+
+/*
+ * lwp keys (see lwp_key_create). The values of the first `LWP_KEYS_INLINE`
+ * keys live in the thread's cold storage, the rest in a per thread table that
+ * is grown on lwp_setspecific.
+ * Keys are shared by every runtime. They are created under `lwp_keys_lock`
+ * into a table that never moves, and `lwp_num_keys` is only raised after the
+ * destructor is stored, so other OS threads can read both without the lock
+ */
+#define LWP_KEYS_INLINE 8
+#define LWP_KEY_DTOR_ITERATIONS 4
+static void (*lwp_key_dtors[LWP_KEYS_MAX])(void *);
+static _Atomic lwp_key_t lwp_num_keys = 0;
+static pthread_mutex_t lwp_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* whether stack usage is sampled when threads exit */
+static bool lwp_stack_watermarks = false;
+/* deepest stack usage seen per entry function, open addressed by entry */
+struct stack_entry_usage_st {
+    lwpfun entry;
+    uint64_t peak;
+    uint64_t samples;
+    uint64_t saved_avg;     /* moving average of shared stack save sizes */
+};
+#define STACK_ENTRIES_INITIAL_CAP 64
+
+/*
+ * A runtime: the threads, the scheduler and everything else the switch path
+ * touches. Each OS thread uses the runtime `lwp_rt` points to, the default
+ * one until it calls lwp_runtime_start_on_this_thread, so runtimes on
+ * different OS threads share no state that is written when switching. What
+ * stays global is set up once (stack growth), guarded by a lock (keys) or
+ * follows one OS thread (the watchdog, the profiler, shared memory stats)
+ */
+struct lwp_runtime_st {
+    /* the scheduler set with lwp_set_scheduler, NULL until there is one */
+    struct scheduler_st current_scheduler;
+    scheduler current_scheduler_ptr;
+    /* state of rr_scheduler and the group scheduler */
+    struct rr_ring_st rr;
+    struct __group_globals_st group;
+
+    /*
+     * Thread storage is split in two, both indexed by tid: `threads` holds
+     * the `struct threadinfo_st`s, one cache line each, with what schedulers
+     * look at (tid, status, links), so walking them doesn't pull in register
+     * files. Everything else, including the saved registers and stack, lives
+     * in `thread_cold`
+     */
+    thread_context **threads;
+    struct thread_cold_st **thread_cold;
+    /* number of thread slots allocated, a multiple of `THREADS_PER_PAGE` */
+    uint64_t num_threads;
+    /* no slot below this index is unused, so searches for one start here */
+    uint64_t first_free;
+    tid_t cur_tid;
+    /* number of threads that have not terminated */
+    uint64_t live_threads;
+    /* total number of context switches */
+    uint64_t switches;
+    /* bytes of stack currently mapped for threads */
+    uint64_t stack_bytes;
+    /* terminated threads whose stacks have not been unmapped yet */
+    thread zombies;
+
+    /* admission control, see `struct admission_waiter_st` */
+    uint64_t limit_threads;
+    uint64_t limit_stack_bytes;
+    int limit_policy;
+    struct admission_waiter_st *admission_waiters;
+    uint64_t creates_rejected;
+    uint64_t creates_waited;
+
+    /* shared stack mode, see lwp_create_shared() */
+    stack *shared_stack;
+    size_t shared_stack_size;
+    thread shared_owner;
+    /* context (and stack) used to copy frames onto the shared stack when the
+     * thread being switched away from is running on it */
+    rfile switcher_state;
+    stack *switcher_stack;
+    thread switch_to;
+
+    /* stackless tasks, see `struct task_st` */
+    struct task_st *tasks;
+    uint64_t tasks_head;
+    uint64_t tasks_len;
+    uint64_t tasks_cap;
+    bool in_task;
+    uint64_t tasks_spawned;
+    uint64_t tasks_run;
+    uint64_t task_cycles;
+
+    /*
+     * state of lwp_run_once / lwp_run_for. While `hosting` the caller of
+     * those (the host) is saved in `host_state` and is not a thread, and
+     * lwp_yield switches back to it once `host_budget` dispatches have been
+     * made, `host_deadline` has passed, lwp_stop was called or nothing is
+     * runnable
+     */
+    rfile host_state;
+    bool hosting;
+    uint64_t host_budget;
+    uint64_t host_deadline;
+    uint64_t host_dispatches;
+    volatile sig_atomic_t stop_requested;
+
+    /* tsc when the running thread was dispatched */
+    uint64_t dispatch_tsc;
+    /* set while the runtime sleeps waiting for wake-ups */
+    volatile bool idle;
+
+    /* wake-ups and posts from other OS threads, see `struct inbox_node_st` */
+    struct inbox_node_st inbox_stub;
+    struct inbox_node_st *inbox_head;
+    _Atomic(struct inbox_node_st *) inbox_tail;
+    atomic_bool inbox_signaled;
+    atomic_int inbox_fd;
+    /* threads in lwp_park */
+    uint64_t parked_threads;
+
+    /* free lwp_alloc() chunks */
+    struct arena_chunk_st *arena_pool;
+    uint64_t arena_pool_len;
+
+    /* admit-to-dispatch delays across all schedulers */
+    struct lwp_hist latency_hist;
+    /* stack usage per entry function, see `struct stack_entry_usage_st` */
+    struct stack_entry_usage_st *stack_entries;
+    uint64_t stack_entries_cap;
+    uint64_t stack_entries_len;
+
+    /* set by lwp_runtime_start_on_this_thread, the default runtime has none */
+    bool bound;
+    pthread_t owner;
+};
+
+#define RUNTIME_INITIALIZER(rt)                                               \
+    {                                                                         \
+        .current_scheduler_ptr = NULL,                                        \
+        .group = GROUP_GLOBALS_INITIALIZER,                                   \
+        .first_free = THREAD_CTR_START,                                       \
+        .cur_tid = NO_THREAD,                                                 \
+        .limit_policy = LWP_LIMIT_FAIL,                                       \
+        .inbox_head = &(rt).inbox_stub,                                       \
+        .inbox_tail = &(rt).inbox_stub,                                       \
+        .inbox_fd = -1,                                                       \
+    }
+
+static struct lwp_runtime_st lwp_default_runtime =
+    RUNTIME_INITIALIZER(lwp_default_runtime);
+static __thread lwp_runtime lwp_rt = &lwp_default_runtime;
+
+static inline struct rr_ring_st *runtime_rr_ring(void) {
+    return &lwp_rt->rr;
+}
+
+static inline struct __group_globals_st *runtime_group_globals(void) {
+    return &lwp_rt->group;
+}
+
+#ifdef DEBUG
 #define dbg(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define dbg(...)
+#endif
+
+/**
+ * The part of a thread that the scheduler doesn't need to look at: its stack,
+ * saved registers and bookkeeping. Stored in `thread_cold`
+ */
+struct thread_cold_st {
+    stack *stack;           /* Base of allocated stack */
+    size_t stacksize;       /* Size of allocated stack */
+    rfile state;            /* saved registers */
+    lwpfun entry;           /* function passed to lwp_create */
+    uint64_t created_ns;    /* CLOCK_MONOTONIC time at creation */
+    uint64_t switches;      /* number of times the thread yielded */
+    uint64_t run_cycles;    /* cycles spent running */
+    uint64_t ready_cycles;  /* cycles spent runnable but not running */
+    uint64_t last_tsc;      /* tsc when the thread last started running
+                               or last became runnable */
+    uint64_t admit_tsc;     /* tsc when the thread was admitted or 0 if it
+                               has been dispatched since */
+    uint64_t published_cycles; /* run_cycles at the last stats publish */
+    uint64_t stack_peak;    /* deepest stack usage sampled, in bytes */
+    uint64_t stack_committed; /* bytes at the top of the stack that are
+                                 accessible, the rest is the growth region */
+    bool shared;            /* runs on the runtime's `shared_stack` */
+    unsigned char *save_buf; /* live part of the stack while not the owner */
+    size_t save_len;
+    size_t save_cap;
+    struct arena_chunk_st *arena; /* chunks of lwp_alloc() memory, newest
+                                     (the one being bumped) first */
+    char *arena_next;       /* next free byte in the newest chunk */
+    char *arena_end;        /* end of the newest chunk */
+    void *specific[LWP_KEYS_INLINE]; /* values of the first lwp keys */
+    void **specific_more;   /* values of keys past LWP_KEYS_INLINE */
+    size_t specific_more_cap;
+    bool parked;            /* removed from the scheduler by lwp_park */
+    bool permit;            /* woken while not parked, next park returns */
+    struct lwp_future_st *future; /* completed when the thread exits */
+    thread zombie_next;     /* next in the runtime's `zombies` */
+};
+
+static inline thread thread_at(uint64_t i) {
+    return &lwp_rt->threads[i / THREADS_PER_PAGE][i % THREADS_PER_PAGE];
+}
+
+static inline struct thread_cold_st *thread_cold(thread t) {
+    return &lwp_rt->thread_cold[t->tid / THREADS_PER_PAGE]
+                               [t->tid % THREADS_PER_PAGE];
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Returns the number of tsc cycles per nanosecond, measuring it against
+ * CLOCK_MONOTONIC the first time it is called
+ */
+double tsc_per_ns(void) {
+    static double rate = 0;
+    if (rate == 0) {
+        struct timespec delay = {0, 10 * 1000 * 1000};
+        uint64_t start_ns = monotonic_ns();
+        uint64_t start_tsc = rdtsc();
+        nanosleep(&delay, NULL);
+        rate = (double)(rdtsc() - start_tsc) / (monotonic_ns() - start_ns);
+    }
+    return rate;
+}
 
 rlim_t get_stack_size() {
     struct rlimit rlim;
@@ -38,26 +513,92 @@ rlim_t get_stack_size() {
     return stack_limit;
 }
 
-stack *stack_new() {
-    uint32_t stack_size = get_stack_size();
+/**
+ * Maps a stack of `stack_size` bytes of which only the top `commit` bytes are
+ * accessible. The rest is reserved but inaccessible so touching it faults and
+ * lets `stack_grow_handler` extend the stack.
+ * Returns MAP_FAILED on failure
+ */
+stack *stack_new(size_t stack_size, size_t commit) {
     int prot = PROT_READ | PROT_WRITE;
     int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK;
     // let mmap choose fd
     int fd = -1;
     off_t offset = 0;
+    if (commit < stack_size) {
+        prot = PROT_NONE;
+        flags |= MAP_NORESERVE;
+    }
     stack *stack = mmap(NULL, stack_size, prot, flags, fd, offset);
+    if (stack == MAP_FAILED) {
+        return stack;
+    }
+    if (commit < stack_size) {
+        void *committed = (char *)stack + stack_size - commit;
+        if (mprotect(committed, commit, PROT_READ | PROT_WRITE) == -1) {
+            munmap(stack, stack_size);
+            return MAP_FAILED;
+        }
+    }
+    lwp_rt->stack_bytes += commit;
     return stack;
 }
 
-void stack_free(stack *stack) {
-    size_t stack_size = get_stack_size();
+/**
+ * Maps `n` stacks laid out back to back in one mapping, each as if by
+ * stack_new(stack_size, commit). They can be freed individually with
+ * stack_free(). Returns MAP_FAILED on failure
+ */
+stack *stack_new_many(uint64_t n, size_t stack_size, size_t commit) {
+    uint64_t i;
+    int prot = PROT_READ | PROT_WRITE;
+    // stacks are only touched as they grow, don't have the kernel refuse
+    // the whole batch because it adds up to more than memory
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE;
+    stack *stacks = mmap(NULL, n * stack_size, prot, flags, -1, 0);
+    if (stacks == MAP_FAILED) {
+        return stacks;
+    }
+    lwp_rt->stack_bytes += n * commit;
+    if (commit >= stack_size) {
+        return stacks;
+    }
+    // leave everything but the top `commit` bytes of each stack inaccessible
+    for (i = 0; i < n; i++) {
+        void *low = (char *)stacks + i * stack_size;
+        if (mprotect(low, stack_size - commit, PROT_NONE) == -1) {
+            munmap(stacks, n * stack_size);
+            lwp_rt->stack_bytes -= n * commit;
+            return MAP_FAILED;
+        }
+    }
+    return stacks;
+}
+
+/**
+ * Returns how much of a new stack of the given size starts out accessible
+ */
+static size_t stack_initial_commit(size_t stack_size) {
+    if (lwp_stack_initial != 0 && lwp_stack_initial < stack_size) {
+        return lwp_stack_initial;
+    }
+    return stack_size;
+}
+
+static int stack_grow_install_handler(void);
+
+void stack_free(stack *stack, size_t stack_size, size_t commit) {
     munmap(stack, stack_size);
+    lwp_rt->stack_bytes -= commit;
 }
 
 void thread_mark_unused(thread t) {
     if (t == NULL) {
         return;
     }
+    if (t->tid != NO_THREAD && t->tid < lwp_rt->first_free) {
+        lwp_rt->first_free = t->tid;
+    }
     // set tid to NO_THREAD to indicate the thread has not been initialized
     t->tid = NO_THREAD;
 }
@@ -83,16 +624,18 @@ void thread_mark_used(thread t, tid_t tid) {
 * in the thread list
  */
 thread thread_list_find_empty() {
-    int i;
-    // i = 1 to skip the first `NO_THREAD` tid
-    for (i = 1; i < lwp_num_threads; i++) {
-        thread t = &lwp_threads[i];
+    uint64_t i;
+    // starts at least at 1 to skip the first `NO_THREAD` tid
+    for (i = lwp_rt->first_free; i < lwp_rt->num_threads; i++) {
+        thread t = thread_at(i);
         if (thread_is_unused(t)) {
             // found an empty thread
             thread_mark_used(t, i);
+            lwp_rt->first_free = i + 1;
             return t;
         }
     }
+    lwp_rt->first_free = lwp_rt->num_threads;
     return NULL;
 }
 
@@ -108,53 +651,121 @@ bool thread_list_has_empty() {
     return true;
 }
 
+/**
+ * Adds pages to the thread list until it has `new_cap` slots, marking the new
+ * slots unused. Returns false if memory ran out
+ */
+static bool thread_list_grow(uint64_t new_cap) {
+    uint64_t i;
+    uint64_t old_pages = lwp_rt->num_threads / THREADS_PER_PAGE;
+    uint64_t new_pages = (new_cap + THREADS_PER_PAGE - 1) / THREADS_PER_PAGE;
+
+    thread_context **hot = (thread_context **)realloc(
+        lwp_rt->threads, new_pages * sizeof(thread_context *));
+    if (hot == NULL) {
+        return false;
+    }
+    lwp_rt->threads = hot;
+    struct thread_cold_st **cold = (struct thread_cold_st **)realloc(
+        lwp_rt->thread_cold, new_pages * sizeof(struct thread_cold_st *));
+    if (cold == NULL) {
+        return false;
+    }
+    lwp_rt->thread_cold = cold;
+    for (i = old_pages; i < new_pages; i++) {
+        lwp_rt->threads[i] = (thread_context *)aligned_alloc(
+            sizeof(thread_context), THREADS_PER_PAGE * sizeof(thread_context));
+        lwp_rt->thread_cold[i] = (struct thread_cold_st *)aligned_alloc(
+            16, THREADS_PER_PAGE * sizeof(struct thread_cold_st));
+        if (lwp_rt->threads[i] == NULL || lwp_rt->thread_cold[i] == NULL) {
+            return false;
+        }
+        // a zeroed thread has a tid of `NO_THREAD`, marking it unused
+        memset(lwp_rt->threads[i], 0,
+               THREADS_PER_PAGE * sizeof(thread_context));
+        memset(lwp_rt->thread_cold[i], 0,
+               THREADS_PER_PAGE * sizeof(struct thread_cold_st));
+        lwp_rt->num_threads = (i + 1) * THREADS_PER_PAGE;
+    }
+    return true;
+}
+
 /**
  * Ensures the thread list has capacity for additional threads
- * If the thread list is not initialized, it is initialized with
- * `DEFAULT_NUM_THREADS` Otherwise thre thread list is reallocated with double
- * the capacity or `MAX_THREADS` whichever is smaller. If the thread list is
+ * If the thread list is not initialized, it is initialized with one page of
+ * `THREADS_PER_PAGE` threads. Otherwise the thread list grows to double the
+ * capacity or `MAX_THREADS` whichever is smaller. If the thread list is
  * already at capacity, no action is taken.
  */
 void thread_list_ensure_empty_cap() {
-    int i;
-    if (lwp_threads == NULL) {
-        lwp_threads =
-            (thread_context *)malloc(DEFAULT_NUM_THREADS * sizeof(thread_context));
-        for (i = 0; i < DEFAULT_NUM_THREADS; i++) {
-            thread_mark_unused(&lwp_threads[i]);
+    if (lwp_rt->threads == NULL) {
+        if (!thread_list_grow(THREADS_PER_PAGE)) {
+            fprintf(stderr, "Failed to allocate space for threads");
+            exit(1);
         }
-        lwp_num_threads = DEFAULT_NUM_THREADS;
         return;
     }
     if (thread_list_has_empty()) {
         // if empty thread found, return, as their is capacity for new threads
         return;
     }
-    if (lwp_num_threads == MAX_THREADS) {
+    if (lwp_rt->num_threads == MAX_THREADS) {
         // if new_cap is greater than MAX_THREADS, do nothing
         // (trying to initialize a new thread will fail)
         return;
     }
 
-    // if no empty thread found, reallocate
-    uint64_t new_cap = lwp_num_threads * 2;
+    // if no empty thread found, add pages
+    uint64_t new_cap = lwp_rt->num_threads * 2;
     if (new_cap >= MAX_THREADS) {
         new_cap = MAX_THREADS;
     }
-    thread_context* tmp = (thread_context *)realloc(lwp_threads, new_cap * sizeof(thread_context));
-    if (tmp == NULL) {
-        free(lwp_threads);
+    if (!thread_list_grow(new_cap)) {
         fprintf(stderr, "Failed to allocate more space for new threads");
         exit(1);
     }
-    lwp_threads = tmp;
-    lwp_num_threads = new_cap;
     return;
 }
 
+/**
+ * Finds `n` unused threads, growing the thread list at most once, and marks
+ * them used, storing them in `out`. Returns false (with none of them marked)
+ * if there isn't room for them
+ */
+static bool thread_list_reserve(thread *out, uint64_t n) {
+    uint64_t found = 0;
+    uint64_t i;
+
+    if (lwp_rt->threads == NULL) {
+        thread_list_ensure_empty_cap();
+    }
+    for (i = lwp_rt->first_free; found < n; i++) {
+        if (i >= lwp_rt->num_threads) {
+            // the rest are all unused, make room for them in one go
+            uint64_t new_cap = lwp_rt->num_threads * 2;
+            if (new_cap < lwp_rt->num_threads + (n - found)) {
+                new_cap = lwp_rt->num_threads + (n - found);
+            }
+            if (new_cap >= MAX_THREADS || !thread_list_grow(new_cap)) {
+                while (found > 0) {
+                    thread_mark_unused(out[--found]);
+                }
+                return false;
+            }
+        }
+        thread t = thread_at(i);
+        if (thread_is_unused(t)) {
+            thread_mark_used(t, i);
+            out[found++] = t;
+        }
+    }
+    lwp_rt->first_free = i;
+    return true;
+}
+
 thread thread_new() {
     thread_list_ensure_empty_cap();
-    if (lwp_threads == NULL) {
+    if (lwp_rt->threads == NULL) {
         return NULL;
     }
     thread empty_thread = thread_list_find_empty();
@@ -167,26 +778,79 @@ thread thread_new() {
 }
 
 void thread_init_ctx_no_stack(thread t) {
-    t->stacksize = get_stack_size();
+    struct thread_cold_st *cold = thread_cold(t);
+    cold->stacksize = lwp_stack_max != 0 ? lwp_stack_max : get_stack_size();
     t->status = LWP_LIVE;
+    lwp_rt->live_threads++;
     t->lib_one = NULL;
     t->lib_two = NULL;
     t->sched_one = NULL;
     t->sched_two = NULL;
     t->exited = NULL;
-    memset(&t->state, 0, sizeof(rfile));
-    t->state.fxsave = FPU_INIT;
+    memset(&cold->state, 0, sizeof(rfile));
+    cold->state.fxsave = FPU_INIT;
+}
+
+void thread_init_cold(thread t, lwpfun fun) {
+    struct thread_cold_st *cold = thread_cold(t);
+    memset(cold, 0, sizeof(*cold));
+    cold->entry = fun;
+    cold->created_ns = monotonic_ns();
+    cold->last_tsc = rdtsc();
+}
+
+int thread_get_state(thread t) {
+    if (thread_is_unused(t)) {
+        return LWP_STATE_UNUSED;
+    }
+    if (LWPTERMINATED(t->status)) {
+        return LWP_STATE_TERMINATED;
+    }
+    if (thread_cold(t)->parked) {
+        return LWP_STATE_BLOCKED;
+    }
+    if (t->tid == lwp_rt->cur_tid) {
+        return LWP_STATE_RUNNING;
+    }
+    return LWP_STATE_READY;
+}
+
+void thread_fill_stats(thread t, struct lwp_stats_st *out) {
+    struct thread_cold_st *cold = thread_cold(t);
+    int state = thread_get_state(t);
+
+    out->tid = t->tid;
+    out->entry = cold->entry;
+    out->state = state;
+    out->status = t->status;
+    out->switches = cold->switches;
+    out->preemptions = 0;
+    out->run_cycles = cold->run_cycles;
+    out->ready_cycles = cold->ready_cycles;
+    out->created_ns = cold->created_ns;
+    // include the interval that is still in progress
+    if (state == LWP_STATE_RUNNING) {
+        out->run_cycles += rdtsc() - cold->last_tsc;
+    } else if (state == LWP_STATE_READY) {
+        out->ready_cycles += rdtsc() - cold->last_tsc;
+    }
 }
 
 void thread_init_ctx(thread t) {
     thread_init_ctx_no_stack(t);
-    t->stack = stack_new();
+    struct thread_cold_st *cold = thread_cold(t);
+    size_t commit = stack_initial_commit(cold->stacksize);
+    cold->stack = stack_new(cold->stacksize, commit);
+    cold->stack_committed = commit;
 }
 
 void thread_mark_terminated(thread t, thread_status_t status) {
     if (t == NULL) {
         return;
     }
+    if (!LWPTERMINATED(t->status)) {
+        lwp_rt->live_threads--;
+    }
     t->status = MKTERMSTAT(LWP_TERM, status);
 }
 
@@ -194,10 +858,255 @@ uint64_t thread_get_stack_len(thread t) {
     if (t == NULL) {
         return 0;
     }
-    uint64_t stack_size = t->stacksize;
+    uint64_t stack_size = thread_cold(t)->stacksize;
     return stack_size / sizeof(stack);
 }
 
+/**
+ * Returns the thread whose growth region contains addr, or NULL
+ */
+static thread stack_find_owner(uintptr_t addr) {
+    uint64_t i;
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    if (cur != NULL) {
+        struct thread_cold_st *cold = thread_cold(cur);
+        if (cold->stack != NULL && !cold->shared &&
+            addr >= (uintptr_t)cold->stack &&
+            addr < (uintptr_t)cold->stack + cold->stacksize) {
+            return cur;
+        }
+    }
+    // a thread may touch another's stack through a pointer
+    for (i = 1; i < lwp_rt->num_threads; i++) {
+        thread t = thread_at(i);
+        if (thread_is_unused(t)) {
+            continue;
+        }
+        struct thread_cold_st *cold = thread_cold(t);
+        if (cold->stack == NULL || cold->shared) {
+            continue;
+        }
+        if (addr >= (uintptr_t)cold->stack &&
+            addr < (uintptr_t)cold->stack + cold->stacksize) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * SIGSEGV handler (run on `lwp_sigaltstack` since the faulting stack is out of
+ * room) that grows a thread's accessible stack when it faults in the
+ * reserved region below it. At least doubles the accessible region to keep the
+ * number of faults logarithmic, but never makes the lowest `STACK_GUARD_SIZE`
+ * bytes accessible so running off the end still crashes.
+ * Faults it can't handle are passed on to the previous handler
+ */
+static void stack_grow_handler(int sig, siginfo_t *info, void *ucontext) {
+    int saved_errno = errno;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    size_t page = getpagesize();
+    thread t = stack_find_owner(addr);
+
+    if (t != NULL) {
+        struct thread_cold_st *cold = thread_cold(t);
+        uintptr_t top = (uintptr_t)cold->stack + cold->stacksize;
+        uintptr_t committed_low = top - cold->stack_committed;
+        uintptr_t limit = (uintptr_t)cold->stack + STACK_GUARD_SIZE;
+        if (addr >= limit && addr < committed_low) {
+            uintptr_t new_low = top - 2 * cold->stack_committed;
+            uintptr_t fault_page = addr & ~(page - 1);
+            if (fault_page < new_low) {
+                new_low = fault_page;
+            }
+            if (new_low < limit || new_low > top) {
+                new_low = limit;
+            }
+            if (mprotect((void *)new_low, committed_low - new_low,
+                         PROT_READ | PROT_WRITE) == 0) {
+                lwp_rt->stack_bytes += committed_low - new_low;
+                cold->stack_committed = top - new_low;
+                errno = saved_errno;
+                return;
+            }
+        }
+        static const char msg[] = "lwp: stack overflow\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    }
+
+    // not ours: hand it to whoever was there before, returning with the
+    // default action restored makes the fault happen again and kill us
+    if (lwp_prev_segv_action.sa_flags & SA_SIGINFO) {
+        lwp_prev_segv_action.sa_sigaction(sig, info, ucontext);
+    } else if (lwp_prev_segv_action.sa_handler != SIG_DFL &&
+               lwp_prev_segv_action.sa_handler != SIG_IGN) {
+        lwp_prev_segv_action.sa_handler(sig);
+    } else {
+        signal(SIGSEGV, SIG_DFL);
+    }
+    errno = saved_errno;
+}
+
+static void stack_grow_install_sigaction(void) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = stack_grow_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &lwp_prev_segv_action) == -1) {
+        perror("lwp_set_stack_growth: sigaction");
+        lwp_segv_install_error = -1;
+    }
+}
+
+/**
+ * Installs the SIGSEGV handler and gives the calling OS thread the alternate
+ * stack it runs on, if not done already
+ */
+static int stack_grow_install_handler(void) {
+    if (lwp_sigaltstack.ss_sp != NULL) {
+        return 0;
+    }
+    lwp_sigaltstack.ss_size = SIGSTKSZ < 64 * 1024 ? 64 * 1024 : SIGSTKSZ;
+    lwp_sigaltstack.ss_sp = malloc(lwp_sigaltstack.ss_size);
+    lwp_sigaltstack.ss_flags = 0;
+    if (lwp_sigaltstack.ss_sp == NULL) {
+        return -1;
+    }
+    if (sigaltstack(&lwp_sigaltstack, NULL) == -1) {
+        perror("lwp_set_stack_growth: sigaltstack");
+        free(lwp_sigaltstack.ss_sp);
+        lwp_sigaltstack.ss_sp = NULL;
+        return -1;
+    }
+    pthread_once(&lwp_segv_once, stack_grow_install_sigaction);
+    return lwp_segv_install_error;
+}
+
+/**
+ * Returns a buffer with room for a mincore(2) vector covering `len` bytes,
+ * reusing the buffer from the previous call when it is large enough
+ */
+static unsigned char *stack_mincore_vec(size_t len) {
+    static __thread unsigned char *vec = NULL;
+    static __thread size_t vec_len = 0;
+    size_t pages = (len + getpagesize() - 1) / getpagesize();
+    if (pages > vec_len) {
+        unsigned char *tmp = (unsigned char *)realloc(vec, pages);
+        if (tmp == NULL) {
+            return NULL;
+        }
+        vec = tmp;
+        vec_len = pages;
+    }
+    return vec;
+}
+
+static void stack_entry_record(lwpfun entry, uint64_t usage);
+
+/**
+ * Finds how deep the thread's stack has been used by asking the kernel which
+ * of its pages are resident: the stack grows down, so the lowest resident page
+ * bounds the deepest usage. Pages that were swapped out or trimmed are not
+ * seen, which is why the peak is kept across samples.
+ * Returns the thread's peak usage in bytes
+ */
+uint64_t thread_sample_stack(thread t) {
+    struct thread_cold_st *cold = thread_cold(t);
+    uint64_t i;
+
+    if (cold->stack == NULL || cold->shared) {
+        // other threads' frames would be counted on the shared stack
+        return cold->stack_peak;
+    }
+    unsigned char *vec = stack_mincore_vec(cold->stacksize);
+    if (vec == NULL || mincore(cold->stack, cold->stacksize, vec) == -1) {
+        return cold->stack_peak;
+    }
+    uint64_t pages = cold->stacksize / getpagesize();
+    for (i = 0; i < pages; i++) {
+        if (vec[i] & 1) {
+            break;
+        }
+    }
+    uint64_t usage = (pages - i) * getpagesize();
+    if (usage > cold->stack_peak) {
+        cold->stack_peak = usage;
+    }
+    stack_entry_record(cold->entry, cold->stack_peak);
+    return cold->stack_peak;
+}
+
+static struct stack_entry_usage_st *stack_entry_find(lwpfun entry) {
+    uint64_t mask = lwp_rt->stack_entries_cap - 1;
+    uint64_t i = ((uint64_t)entry >> 4) & mask;
+    while (lwp_rt->stack_entries[i].entry != NULL &&
+           lwp_rt->stack_entries[i].entry != entry) {
+        i = (i + 1) & mask;
+    }
+    return &lwp_rt->stack_entries[i];
+}
+
+static void stack_entry_grow(void) {
+    uint64_t i;
+    struct stack_entry_usage_st *old = lwp_rt->stack_entries;
+    uint64_t old_cap = lwp_rt->stack_entries_cap;
+    uint64_t new_cap = old_cap == 0 ? STACK_ENTRIES_INITIAL_CAP : old_cap * 2;
+
+    struct stack_entry_usage_st *tmp = (struct stack_entry_usage_st *)calloc(
+        new_cap, sizeof(struct stack_entry_usage_st));
+    if (tmp == NULL) {
+        return;
+    }
+    lwp_rt->stack_entries = tmp;
+    lwp_rt->stack_entries_cap = new_cap;
+    for (i = 0; i < old_cap; i++) {
+        if (old[i].entry != NULL) {
+            *stack_entry_find(old[i].entry) = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * Returns the table entry for the given entry function, adding it if needed,
+ * or NULL if there is no entry function or no room
+ */
+static struct stack_entry_usage_st *stack_entry_get(lwpfun entry) {
+    if (entry == NULL) {
+        // the original system thread's stack isn't ours to measure
+        return NULL;
+    }
+    // keep the table at most half full
+    if (lwp_rt->stack_entries_len * 2 >= lwp_rt->stack_entries_cap) {
+        stack_entry_grow();
+        if (lwp_rt->stack_entries_len * 2 >= lwp_rt->stack_entries_cap) {
+            return NULL;
+        }
+    }
+    struct stack_entry_usage_st *e = stack_entry_find(entry);
+    if (e->entry == NULL) {
+        e->entry = entry;
+        lwp_rt->stack_entries_len++;
+    }
+    return e;
+}
+
+/**
+ * Folds a thread's stack usage into the peak for its entry function
+ */
+static void stack_entry_record(lwpfun entry, uint64_t usage) {
+    struct stack_entry_usage_st *e = stack_entry_get(entry);
+    if (e == NULL) {
+        return;
+    }
+    e->samples++;
+    if (usage > e->peak) {
+        e->peak = usage;
+    }
+}
+
 /**
  * wraps calling the lwpfun so that if they return an exit status without
  * calling lwp_exit, we call lwp_exit for them with the returned status.
@@ -229,7 +1138,12 @@ void stack_frame_set_ret_addr(stack* s, void* addr) {
     s[1] = (unsigned long)addr;
 }
 
-void thread_init_shim_rfile(thread t, lwpfun fun, void* arg) {
+/**
+ * Sets up `state` and the top of the stack `s` (`stack_len` entries long) so
+ * that loading `state` with swap_rfiles() calls entry(arg1, arg2)
+ */
+void rfile_init_shim(rfile *state, stack *s, uint64_t stack_len, void *entry,
+                     unsigned long arg1, unsigned long arg2) {
     /*
      * End of function prologue:
      * `leave`;
@@ -244,93 +1158,981 @@ void thread_init_shim_rfile(thread t, lwpfun fun, void* arg) {
      * popq %rbp ; pop the stack into the base pointer
      * popq %rip ; pop the stack into the instruction pointer
     */
-    if (t == NULL) {
-        return;
-    }
-    uint64_t stack_len = thread_get_stack_len(t);
-    stack* lwp_wrap_stack_base = prev_16b_aligned_ptr(&t->stack[stack_len - 1]);
-    // stack* lwp_wrap_stack_base = prev_16b_aligned_ptr(&t->stack[4]);
+    stack* lwp_wrap_stack_base = prev_16b_aligned_ptr(&s[stack_len - 1]);
 
     assert(lwp_wrap_stack_base != NULL);
     assert((uint64_t)lwp_wrap_stack_base % 16 == 0);
 
     // the pointer to the stack frame of the dummy function `swap_rfiles` will
     // tear down with room for the two values (and some change)
-    // that `leave` will pop off the stack
-    stack* dummy_frame_stack_base = prev_16b_aligned_ptr(&lwp_wrap_stack_base[-2]);
+    // that `leave` will pop off the stack.
+    // `leave; ret` pops two words, and the ABI expects %rsp + 8 to be 16 byte
+    // aligned on function entry, so the frame must sit 8 bytes off alignment
+    stack* dummy_frame_stack_base = prev_16b_aligned_ptr(&lwp_wrap_stack_base[-2]) - 1;
 
     // movq %rbp, %rsp ; copy base pointer to stack pointer
     // in order for stack pointer to be setup by swap_rfiles, %rbp must be set
     // to the base of the stack
-    t->state.rbp = (unsigned long)dummy_frame_stack_base;
+    state->rbp = (unsigned long)dummy_frame_stack_base;
 
     // popq %rbp ; pop the stack into the base pointer
     // set the address of the stack frame that will be returned to by `leave`
     // to be the base of the lwpfun stack frame
     dummy_frame_stack_base[0] = (unsigned long)lwp_wrap_stack_base;
     // popq %rip ; pop the stack into the instruction pointer
-    // set the ip popped off the stack to the address of `lwp_wrap`
-    dummy_frame_stack_base[1] = (unsigned long)lwp_wrap;
+    // set the ip popped off the stack to the address of `entry`
+    dummy_frame_stack_base[1] = (unsigned long)entry;
 
-    // set the first argument to lwp_wrap to be lwpfun
-    t->state.rdi = (unsigned long)fun;
-    // set the second argument to lwp_wrap to be arg
-    t->state.rsi = (unsigned long)arg;
+    // set the first and second arguments to entry
+    state->rdi = arg1;
+    state->rsi = arg2;
 }
 
 
-tid_t lwp_create(lwpfun fun, void *arg) {
-    thread t = thread_new();
-    if (t == NULL) {
-        fprintf(stderr, "lwp_create: failed to create new thread\n");
-        return NO_THREAD;
+/**
+ * Admits the thread to the current scheduler and notes when it became
+ * runnable so the delay until it is dispatched can be recorded
+ */
+void thread_admit(scheduler s, thread t) {
+    thread_cold(t)->admit_tsc = rdtsc();
+    sched_admit(s, t);
+}
+
+/*
+ * Tell the scheduler about thread events, following the interface version
+ * it implements (see LWP_SCHED_VERSION)
+ */
+static void sched_on_block(scheduler s, thread t) {
+#ifdef LWP_STATIC_SCHED
+    (void)s;
+    SCHED_FN(on_block)(t);
+#else
+    if (s->version >= LWP_SCHED_VERSION && s->on_block != NULL) {
+        s->on_block(t);
+    } else {
+        sched_remove(s, t);
     }
-    thread_init_ctx(t);
-    thread_init_shim_rfile(t, fun, arg);
-    scheduler s = lwp_get_scheduler();
-    if (s == NULL) {
-        fprintf(stderr, "lwp_create: scheduler is NULL\n");
-        return NO_THREAD;
+#endif
+}
+
+static void sched_on_wake(scheduler s, thread t) {
+    thread_cold(t)->admit_tsc = rdtsc();
+#ifdef LWP_STATIC_SCHED
+    (void)s;
+    SCHED_FN(on_wake)(t);
+#else
+    if (s->version >= LWP_SCHED_VERSION && s->on_wake != NULL) {
+        s->on_wake(t);
+    } else {
+        sched_admit(s, t);
     }
-    s->admit(t);
-    return t->tid;
+#endif
 }
 
-void lwp_start(void) {
-    thread_list_ensure_empty_cap();
-    // use the reserved thread 0 (`NO_THREAD`) as the main thread
-    thread t = thread_list_find_empty();
-    // init the threads context but do not allocate a stack (use current stack instead)
-    thread_init_ctx_no_stack(t);
-    t->stack = NULL;
-    scheduler s = lwp_get_scheduler();
-    if (s == NULL) {
-        fprintf(stderr, "lwp_start: scheduler is NULL\n");
+static void sched_on_exit(scheduler s, thread t) {
+#ifdef LWP_STATIC_SCHED
+    (void)s;
+    SCHED_FN(on_exit)(t);
+#else
+    if (s->version < LWP_SCHED_VERSION) {
+        // left in the pool, older schedulers skip terminated threads
         return;
     }
-    s->admit(t);
-    // save current register values in t->state
-    swap_rfiles(&t->state, NULL);
-
-    lwp_cur_tid = t->tid;
-    lwp_yield();
+    if (s->on_exit != NULL) {
+        s->on_exit(t);
+    } else {
+        sched_remove(s, t);
+    }
+#endif
 }
 
-int thread_get_status(thread t) {
-    if (t == NULL) {
-        return LWP_TERM;
+static inline void sched_on_yield(thread t, uint64_t ran_cycles) {
+#ifdef LWP_STATIC_SCHED
+#if SCHED_FN(HAS_ON_YIELD)
+    if (!LWPTERMINATED(t->status)) {
+        SCHED_FN(on_yield)(t, ran_cycles);
     }
-    return LWPTERMSTAT(t->status);
+#else
+    (void)t;
+    (void)ran_cycles;
+#endif
+#else
+    scheduler s = &lwp_rt->current_scheduler;
+    if (s->version >= LWP_SCHED_VERSION && s->on_yield != NULL &&
+        !LWPTERMINATED(t->status)) {
+        s->on_yield(t, ran_cycles);
+    }
+#endif
 }
 
-// FIXME: snakes demos are failing in snakes code
-// with a segmentation fault
-void lwp_yield(void) {
-    scheduler s = lwp_get_scheduler();
-    thread next = s->next();
-    tid_t cur_tid = lwp_gettid();
+/**
+ * Admits the threads with the scheduler's admit_batch if it has one, one at
+ * a time otherwise
+ */
+static void sched_admit_batch(scheduler s, thread *threads, int n) {
+    int i;
+#ifdef LWP_STATIC_SCHED
+#if SCHED_FN(HAS_ADMIT_BATCH)
+    (void)s;
+    (void)i;
+    SCHED_FN(admit_batch)(threads, n);
+    return;
+#endif
+#else
+    if (s->admit_batch != NULL) {
+        s->admit_batch(threads, n);
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++) {
+        sched_admit(s, threads[i]);
+    }
+}
+
+void thread_init_shim_rfile(thread t, lwpfun fun, void* arg) {
+    if (t == NULL) {
+        return;
+    }
+    struct thread_cold_st *cold = thread_cold(t);
+    rfile_init_shim(&cold->state, cold->stack, thread_get_stack_len(t), lwp_wrap,
+                    (unsigned long)fun, (unsigned long)arg);
+}
+
+/**
+ * Copies the live part of the thread's stack (its saved %rsp up to the top of
+ * the shared stack) into its save buffer, growing the buffer to fit.
+ * Returns 0 on success or -1 if the buffer could not be grown
+ */
+static int shared_stack_save(thread t) {
+    struct thread_cold_st *cold = thread_cold(t);
+    uintptr_t top = (uintptr_t)cold->stack + cold->stacksize;
+    size_t len = top - cold->state.rsp;
+
+    if (len > cold->save_cap) {
+        // round up so a thread that wobbles around one depth doesn't realloc
+        // on every switch
+        size_t cap = (len + 255) & ~(size_t)255;
+        unsigned char *tmp = (unsigned char *)realloc(cold->save_buf, cap);
+        if (tmp == NULL) {
+            return -1;
+        }
+        lwp_rt->stack_bytes += cap - cold->save_cap;
+        cold->save_buf = tmp;
+        cold->save_cap = cap;
+    }
+    memcpy(cold->save_buf, (void *)cold->state.rsp, len);
+    cold->save_len = len;
+
+    struct stack_entry_usage_st *e = stack_entry_get(cold->entry);
+    if (e != NULL) {
+        e->saved_avg = e->saved_avg - e->saved_avg / 8 + len / 8;
+    }
+    return 0;
+}
+
+static void shared_stack_release(thread t) {
+    struct thread_cold_st *cold = thread_cold(t);
+    lwp_rt->stack_bytes -= cold->save_cap;
+    free(cold->save_buf);
+    cold->save_buf = NULL;
+    cold->save_len = 0;
+    cold->save_cap = 0;
+}
+
+/**
+ * Puts `t`'s frames on the shared stack, first saving the frames of the thread
+ * that is there. Must not be called while running on the shared stack
+ */
+static void shared_stack_load(thread t) {
+    thread owner = lwp_rt->shared_owner;
+    if (owner != NULL && !LWPTERMINATED(owner->status)) {
+        if (shared_stack_save(owner) == -1) {
+            fprintf(stderr, "lwp_yield: failed to save shared stack of %lu\n",
+                    owner->tid);
+            exit(1);
+        }
+    }
+    struct thread_cold_st *cold = thread_cold(t);
+    uintptr_t top = (uintptr_t)cold->stack + cold->stacksize;
+    memcpy((void *)(top - cold->save_len), cold->save_buf, cold->save_len);
+    lwp_rt->shared_owner = t;
+}
+
+/**
+ * Body of the switcher context. Switching between two threads that both use
+ * the shared stack can't copy frames while running on the outgoing thread's
+ * stack, so lwp_yield saves the outgoing thread's registers by loading this
+ * context, which copies the frames and then loads `switch_to`
+ */
+static void shared_stack_switcher(void) {
+    while (true) {
+        shared_stack_load(lwp_rt->switch_to);
+        swap_rfiles(&lwp_rt->switcher_state,
+                    &thread_cold(lwp_rt->switch_to)->state);
+    }
+}
+
+static int shared_stack_init(void) {
+    if (lwp_rt->shared_stack != NULL) {
+        return 0;
+    }
+    size_t size = get_stack_size();
+    stack *shared = stack_new(size, size);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "lwp_create_shared: failed to allocate shared stack\n");
+        return -1;
+    }
+    lwp_rt->switcher_stack = (stack *)malloc(SWITCHER_STACK_SIZE);
+    if (lwp_rt->switcher_stack == NULL) {
+        stack_free(shared, size, size);
+        return -1;
+    }
+    memset(&lwp_rt->switcher_state, 0, sizeof(rfile));
+    lwp_rt->switcher_state.fxsave = FPU_INIT;
+    rfile_init_shim(&lwp_rt->switcher_state, lwp_rt->switcher_stack,
+                    SWITCHER_STACK_SIZE / sizeof(stack), shared_stack_switcher,
+                    0, 0);
+    lwp_rt->shared_stack = shared;
+    lwp_rt->shared_stack_size = size;
+    return 0;
+}
+
+/**
+ * Switches from `cur` to `next` when `next` runs on the shared stack but its
+ * frames are not there
+ */
+static void shared_stack_switch(thread cur, thread next) {
+    if (cur != lwp_rt->shared_owner) {
+        // not running on the shared stack, safe to copy onto it from here
+        shared_stack_load(next);
+        swap_rfiles(&thread_cold(cur)->state, &thread_cold(next)->state);
+        return;
+    }
+    lwp_rt->switch_to = next;
+    swap_rfiles(&thread_cold(cur)->state, &lwp_rt->switcher_state);
+}
+
+/**
+ * Gives the thread the shared stack, building its initial frame in its save
+ * buffer rather than on the stack (which may hold the owner's frames)
+ */
+static int thread_init_shared_stack(thread t, lwpfun fun, void *arg) {
+    struct thread_cold_st *cold = thread_cold(t);
+    stack saved[2];
+
+    cold->stack = lwp_rt->shared_stack;
+    cold->stacksize = lwp_rt->shared_stack_size;
+    cold->shared = true;
+    uint64_t stack_len = thread_get_stack_len(t);
+    // the shim writes the two words below the top frame, put back whatever
+    // the owner had there once they are copied out
+    stack *dummy_frame = prev_16b_aligned_ptr(
+        &prev_16b_aligned_ptr(&cold->stack[stack_len - 1])[-2]) - 1;
+    memcpy(saved, dummy_frame, sizeof(saved));
+    thread_init_shim_rfile(t, fun, arg);
+    cold->state.rsp = cold->state.rbp;
+    int res = shared_stack_save(t);
+    memcpy(dummy_frame, saved, sizeof(saved));
+    return res;
+}
+
+static void thread_wake(thread t);
+
+static bool admission_over(uint64_t n, uint64_t stack_bytes) {
+    return (lwp_rt->limit_threads != 0 &&
+            lwp_rt->live_threads + n > lwp_rt->limit_threads) ||
+           (lwp_rt->limit_stack_bytes != 0 &&
+            lwp_rt->stack_bytes + stack_bytes > lwp_rt->limit_stack_bytes);
+}
+
+/**
+ * Wakes the longest waiting thread blocked in admission control, for when
+ * a thread exited or a stack was freed
+ */
+static void admission_release(void) {
+    struct admission_waiter_st *w = lwp_rt->admission_waiters;
+    if (w == NULL) {
+        return;
+    }
+    lwp_rt->admission_waiters = w->next;
+    w->queued = false;
+    thread_wake(w->t);
+}
+
+/**
+ * Checks that n more threads with stack_bytes more stack fit in the limits,
+ * parking the calling thread until they do under LWP_LIMIT_WAIT. Returns 0
+ * if they fit or -1 with errno set to EAGAIN if they don't
+ */
+static int admission_check(uint64_t n, uint64_t stack_bytes) {
+    if (!admission_over(n, stack_bytes)) {
+        return 0;
+    }
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    bool can_fit = (lwp_rt->limit_threads == 0 || n <= lwp_rt->limit_threads) &&
+                   (lwp_rt->limit_stack_bytes == 0 ||
+                    stack_bytes <= lwp_rt->limit_stack_bytes);
+    if (lwp_rt->limit_policy != LWP_LIMIT_WAIT || cur == NULL ||
+        lwp_rt->in_task || !can_fit) {
+        lwp_rt->creates_rejected++;
+        errno = EAGAIN;
+        return -1;
+    }
+    lwp_rt->creates_waited++;
+    struct admission_waiter_st w = {.next = NULL, .t = cur, .queued = true};
+    // FIFO, except that a waiter that still doesn't fit goes back in front
+    struct admission_waiter_st **tail = &lwp_rt->admission_waiters;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = &w;
+    while (true) {
+        while (w.queued) {
+            lwp_park();
+        }
+        if (!admission_over(n, stack_bytes)) {
+            break;
+        }
+        w.next = lwp_rt->admission_waiters;
+        w.queued = true;
+        lwp_rt->admission_waiters = &w;
+    }
+    // there may be room for the next one too
+    if (lwp_rt->admission_waiters != NULL && !admission_over(1, 0)) {
+        admission_release();
+    }
+    return 0;
+}
+
+/**
+ * Unmaps the stacks of terminated threads other than `cur`, which may still
+ * be running on its own
+ */
+static void thread_reap_stacks(thread cur) {
+    thread *link = &lwp_rt->zombies;
+    bool freed = false;
+
+    while (*link != NULL) {
+        thread t = *link;
+        struct thread_cold_st *cold = thread_cold(t);
+        if (t == cur) {
+            link = &cold->zombie_next;
+            continue;
+        }
+        *link = cold->zombie_next;
+        cold->zombie_next = NULL;
+        stack_free(cold->stack, cold->stacksize, cold->stack_committed);
+        cold->stack = NULL;
+        cold->stack_committed = 0;
+        freed = true;
+    }
+    if (freed) {
+        admission_release();
+    }
+}
+
+static tid_t thread_create(lwpfun fun, void *arg, bool shared) {
+    size_t stack_bytes = 0;
+    if (!shared) {
+        size_t stack_size =
+            lwp_stack_max != 0 ? lwp_stack_max : get_stack_size();
+        stack_bytes = stack_initial_commit(stack_size);
+        // growth may have been turned on after this OS thread started its
+        // runtime, it needs an alternate stack for the fault handler
+        if (stack_bytes < stack_size && stack_grow_install_handler() == -1) {
+            fprintf(stderr, "lwp_create: failed to set up stack growth\n");
+            return NO_THREAD;
+        }
+    }
+    if (admission_check(1, stack_bytes) == -1) {
+        return NO_THREAD;
+    }
+    thread t = thread_new();
+    if (t == NULL) {
+        fprintf(stderr, "lwp_create: failed to create new thread\n");
+        return NO_THREAD;
+    }
+    thread_init_cold(t, fun);
+    if (shared) {
+        thread_init_ctx_no_stack(t);
+        if (thread_init_shared_stack(t, fun, arg) == -1) {
+            fprintf(stderr, "lwp_create_shared: failed to allocate save buffer\n");
+            thread_cold(t)->stack = NULL;
+            thread_mark_terminated(t, 0);
+            return NO_THREAD;
+        }
+    } else {
+        thread_init_ctx(t);
+        if (thread_cold(t)->stack == MAP_FAILED) {
+            fprintf(stderr, "lwp_create: failed to allocate stack\n");
+            thread_cold(t)->stack = NULL;
+            thread_mark_terminated(t, 0);
+            return NO_THREAD;
+        }
+        thread_init_shim_rfile(t, fun, arg);
+    }
+    scheduler s = lwp_get_scheduler();
+    if (s == NULL) {
+        fprintf(stderr, "lwp_create: scheduler is NULL\n");
+        return NO_THREAD;
+    }
+    thread_admit(s, t);
+    return t->tid;
+}
+
+tid_t lwp_create(lwpfun fun, void *arg) {
+    return thread_create(fun, arg, false);
+}
+
+int lwp_create_many(lwpfun fun, void *args[], int n, tid_t tids[]) {
+    int i;
+
+    if (n <= 0) {
+        return 0;
+    }
+    size_t stack_size = lwp_stack_max != 0 ? lwp_stack_max : get_stack_size();
+    size_t commit = stack_initial_commit(stack_size);
+    if (commit < stack_size && stack_grow_install_handler() == -1) {
+        fprintf(stderr, "lwp_create_many: failed to set up stack growth\n");
+        return -1;
+    }
+    if (admission_check(n, n * commit) == -1) {
+        return -1;
+    }
+    scheduler s = lwp_get_scheduler();
+    thread *threads = (thread *)malloc(n * sizeof(thread));
+    if (threads == NULL) {
+        fprintf(stderr, "lwp_create_many: failed to allocate thread list\n");
+        return -1;
+    }
+    if (!thread_list_reserve(threads, n)) {
+        fprintf(stderr, "lwp_create_many: failed to create new threads\n");
+        free(threads);
+        return -1;
+    }
+    stack *stacks = stack_new_many(n, stack_size, commit);
+    if (stacks == MAP_FAILED) {
+        fprintf(stderr, "lwp_create_many: failed to allocate stacks\n");
+        for (i = 0; i < n; i++) {
+            thread_mark_unused(threads[i]);
+        }
+        free(threads);
+        return -1;
+    }
+
+    uint64_t now = rdtsc();
+    for (i = 0; i < n; i++) {
+        thread t = threads[i];
+        thread_init_cold(t, fun);
+        thread_init_ctx_no_stack(t);
+        struct thread_cold_st *cold = thread_cold(t);
+        cold->stack = (stack *)((char *)stacks + i * stack_size);
+        cold->stack_committed = commit;
+        thread_init_shim_rfile(t, fun, args != NULL ? args[i] : NULL);
+        cold->admit_tsc = now;
+        if (tids != NULL) {
+            tids[i] = t->tid;
+        }
+    }
+    sched_admit_batch(s, threads, n);
+    free(threads);
+    return n;
+}
+
+tid_t lwp_create_shared(lwpfun fun, void *arg) {
+    if (shared_stack_init() == -1) {
+        return NO_THREAD;
+    }
+    // threads of this entry function have been keeping deep stacks, copying
+    // them on every switch would cost more than the memory it saves
+    struct stack_entry_usage_st *e = stack_entry_get(fun);
+    if (e != NULL && e->saved_avg > lwp_shared_promote_depth) {
+        return thread_create(fun, arg, false);
+    }
+    return thread_create(fun, arg, true);
+}
+
+void lwp_start(void) {
+    const char *shm_interval = getenv(SHM_STATS_ENV);
+    if (shm_interval != NULL && atoi(shm_interval) > 0) {
+        lwp_stats_publish(atoi(shm_interval));
+    }
+    thread_list_ensure_empty_cap();
+    // use the reserved thread 0 (`NO_THREAD`) as the main thread
+    thread t = thread_list_find_empty();
+    // init the threads context but do not allocate a stack (use current stack instead)
+    thread_init_cold(t, NULL);
+    thread_init_ctx_no_stack(t);
+    thread_cold(t)->stack = NULL;
+    scheduler s = lwp_get_scheduler();
+    if (s == NULL) {
+        fprintf(stderr, "lwp_start: scheduler is NULL\n");
+        return;
+    }
+    sched_admit(s, t);
+    // save current register values in the thread's state
+    swap_rfiles(&thread_cold(t)->state, NULL);
+
+    lwp_rt->cur_tid = t->tid;
+    lwp_rt->dispatch_tsc = rdtsc();
+    lwp_yield();
+}
+
+int thread_get_status(thread t) {
+    if (t == NULL) {
+        return LWP_TERM;
+    }
+    return LWPTERMSTAT(t->status);
+}
+
+static void thread_record_latency(uint64_t cycles) {
+    lwp_hist_record(&lwp_rt->latency_hist, cycles);
+    struct lwp_hist *sched_hist = lwp_get_scheduler()->latency;
+    if (sched_hist != NULL) {
+        lwp_hist_record(sched_hist, cycles);
+    }
+}
+
+/**
+ * Charges the time since `cur` was dispatched to it and the time since `next`
+ * became runnable to `next`. Called once per switch so kept to a single tsc
+ * read
+ */
+static inline void thread_account_switch(thread cur, thread next) {
+    uint64_t now = rdtsc();
+    struct thread_cold_st *cur_cold = thread_cold(cur);
+    struct thread_cold_st *next_cold = thread_cold(next);
+
+    lwp_rt->switches++;
+    cur_cold->switches++;
+    cur_cold->run_cycles += now - cur_cold->last_tsc;
+    sched_on_yield(cur, now - cur_cold->last_tsc);
+    cur_cold->last_tsc = now;
+
+    next_cold->ready_cycles += now - next_cold->last_tsc;
+    next_cold->last_tsc = now;
+    lwp_rt->dispatch_tsc = now;
+
+    if (next_cold->admit_tsc != 0) {
+        thread_record_latency(now - next_cold->admit_tsc);
+        next_cold->admit_tsc = 0;
+    }
+}
+
+static void shm_stats_unlink(void) {
+    if (lwp_shm_region == NULL) {
+        return;
+    }
+    munmap(lwp_shm_region, sizeof(*lwp_shm_region));
+    shm_unlink(lwp_shm_name);
+    lwp_shm_region = NULL;
+}
+
+/**
+ * Inserts `t` into `top` (sorted by recent_cycles, descending) if it is among
+ * the `LWPSTAT_TOP_N` largest
+ */
+static void shm_stats_top_insert(struct lwpstat_thread *top, uint64_t *ntop,
+                                 const struct lwpstat_thread *t) {
+    uint64_t i = *ntop;
+    if (i == LWPSTAT_TOP_N) {
+        if (top[i - 1].recent_cycles >= t->recent_cycles) {
+            return;
+        }
+        i--;
+    } else {
+        (*ntop)++;
+    }
+    for (; i > 0 && top[i - 1].recent_cycles < t->recent_cycles; i--) {
+        top[i] = top[i - 1];
+    }
+    top[i] = *t;
+}
+
+/**
+ * Rewrites the shared memory stats region. Walks every thread to find the
+ * top CPU consumers so is only called once per publish interval
+ */
+static void shm_stats_publish(uint64_t now_tsc) {
+    struct lwpstat_region *r = lwp_shm_region;
+    struct lwp_stats_st stats;
+    struct lwpstat_thread entry;
+    uint64_t i;
+    uint64_t now_ns = monotonic_ns();
+
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->interval_ns = now_ns - lwp_shm_last_ns;
+    r->interval_cycles = now_tsc - lwp_shm_last_tsc;
+    r->updated_ns = now_ns;
+    r->threads = lwp_rt->live_threads;
+    r->ready = lwp_get_scheduler()->qlen();
+    r->switches = lwp_rt->switches;
+    r->switches_per_sec = 0;
+    if (r->interval_ns != 0) {
+        r->switches_per_sec =
+            (lwp_rt->switches - lwp_shm_last_switches) * 1e9 / r->interval_ns;
+    }
+    r->stack_bytes = lwp_rt->stack_bytes;
+    r->ntop = 0;
+    // i = 1 to skip the first `NO_THREAD` tid
+    for (i = 1; i < lwp_rt->num_threads; i++) {
+        thread t = thread_at(i);
+        if (thread_is_unused(t)) {
+            continue;
+        }
+        struct thread_cold_st *cold = thread_cold(t);
+        thread_fill_stats(t, &stats);
+        entry.tid = stats.tid;
+        entry.entry = (uint64_t)stats.entry;
+        entry.state = stats.state;
+        entry.switches = stats.switches;
+        entry.run_cycles = stats.run_cycles;
+        entry.recent_cycles = stats.run_cycles - cold->published_cycles;
+        cold->published_cycles = stats.run_cycles;
+        shm_stats_top_insert(r->top, &r->ntop, &entry);
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+
+    lwp_shm_last_tsc = now_tsc;
+    lwp_shm_last_ns = now_ns;
+    lwp_shm_last_switches = lwp_rt->switches;
+}
+
+static inline void shm_stats_maybe_publish(void) {
+    uint64_t now = rdtsc();
+    if (now - lwp_shm_last_tsc >= lwp_shm_interval_cycles) {
+        shm_stats_publish(now);
+    }
+}
+
+int lwp_stats_publish(unsigned int interval_ms) {
+    if (interval_ms == 0) {
+        shm_stats_unlink();
+        return 0;
+    }
+    lwp_shm_interval_cycles = (uint64_t)(interval_ms * 1e6 * tsc_per_ns());
+    if (lwp_shm_region != NULL) {
+        return 0;
+    }
+
+    snprintf(lwp_shm_name, sizeof(lwp_shm_name), LWPSTAT_NAME_FMT, getpid());
+    int fd = shm_open(lwp_shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("lwp_stats_publish: shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct lwpstat_region)) == -1) {
+        perror("lwp_stats_publish: ftruncate");
+        close(fd);
+        shm_unlink(lwp_shm_name);
+        return -1;
+    }
+    struct lwpstat_region *r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+        perror("lwp_stats_publish: mmap");
+        shm_unlink(lwp_shm_name);
+        return -1;
+    }
+    r->magic = LWPSTAT_MAGIC;
+    r->version = LWPSTAT_VERSION;
+    r->pid = getpid();
+    lwp_shm_region = r;
+    lwp_shm_rt = lwp_rt;
+    lwp_shm_last_tsc = rdtsc();
+    lwp_shm_last_ns = monotonic_ns();
+    lwp_shm_last_switches = lwp_rt->switches;
+    shm_stats_publish(rdtsc());
+
+    static bool registered = false;
+    if (!registered) {
+        atexit(shm_stats_unlink);
+        registered = true;
+    }
+    return 0;
+}
+
+int lwp_spawn_task(lwpfun fun, void *arg) {
+    if (fun == NULL) {
+        return -1;
+    }
+    if (lwp_rt->tasks_len == lwp_rt->tasks_cap) {
+        uint64_t i;
+        uint64_t new_cap = lwp_rt->tasks_cap == 0 ? TASKS_INITIAL_CAP
+                                              : lwp_rt->tasks_cap * 2;
+        struct task_st *tmp =
+            (struct task_st *)malloc(new_cap * sizeof(struct task_st));
+        if (tmp == NULL) {
+            fprintf(stderr, "lwp_spawn_task: failed to grow task queue\n");
+            return -1;
+        }
+        // unwrap the ring into the front of the new buffer
+        for (i = 0; i < lwp_rt->tasks_len; i++) {
+            tmp[i] =
+                lwp_rt->tasks[(lwp_rt->tasks_head + i) % lwp_rt->tasks_cap];
+        }
+        free(lwp_rt->tasks);
+        lwp_rt->tasks = tmp;
+        lwp_rt->tasks_head = 0;
+        lwp_rt->tasks_cap = new_cap;
+    }
+    uint64_t tail =
+        (lwp_rt->tasks_head + lwp_rt->tasks_len) % lwp_rt->tasks_cap;
+    lwp_rt->tasks[tail].fun = fun;
+    lwp_rt->tasks[tail].arg = arg;
+    lwp_rt->tasks_len++;
+    lwp_rt->tasks_spawned++;
+    return 0;
+}
+
+/**
+ * Runs the tasks that were queued when it was called (tasks they spawn wait
+ * for the next yield so they can't starve the threads) on the current stack.
+ * The time they take is not charged to the thread that yielded
+ */
+static void tasks_run_pending(thread cur) {
+    uint64_t n = lwp_rt->tasks_len;
+    uint64_t start = rdtsc();
+
+    lwp_rt->in_task = true;
+    for (; n > 0; n--) {
+        struct task_st task = lwp_rt->tasks[lwp_rt->tasks_head];
+        lwp_rt->tasks_head = (lwp_rt->tasks_head + 1) % lwp_rt->tasks_cap;
+        lwp_rt->tasks_len--;
+        dbg("lwp_yield: running task %p(%p)\n", (void *)task.fun, task.arg);
+        task.fun(task.arg);
+        lwp_rt->tasks_run++;
+    }
+    lwp_rt->in_task = false;
+
+    uint64_t elapsed = rdtsc() - start;
+    lwp_rt->task_cycles += elapsed;
+    if (cur != NULL) {
+        thread_cold(cur)->last_tsc += elapsed;
+    }
+}
+
+static int inbox_fd(lwp_runtime rt) {
+    int fd = atomic_load(&rt->inbox_fd);
+    if (fd != -1) {
+        return fd;
+    }
+    // may be called from several OS threads at once, the first one wins
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "lwp: eventfd failed: %s\n", strerror(errno));
+        return -1;
+    }
+    int expected = -1;
+    if (!atomic_compare_exchange_strong(&rt->inbox_fd, &expected, fd)) {
+        close(fd);
+        return expected;
+    }
+    return fd;
+}
+
+/**
+ * Pushes a wake-up or post onto the runtime's inbox. Runs on any OS thread,
+ * so it must only touch `rt` and not the caller's own runtime
+ */
+static int inbox_push(lwp_runtime rt, tid_t tid, lwpfun fun, void *arg) {
+    int fd = inbox_fd(rt);
+    if (fd == -1) {
+        return -1;
+    }
+    struct inbox_node_st *node = malloc(sizeof(*node));
+    if (node == NULL) {
+        return -1;
+    }
+    node->tid = tid;
+    node->fun = fun;
+    node->arg = arg;
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct inbox_node_st *prev =
+        atomic_exchange_explicit(&rt->inbox_tail, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+    if (!atomic_exchange_explicit(&rt->inbox_signaled, true,
+                                  memory_order_acq_rel)) {
+        uint64_t one = 1;
+        // only fails if the counter is about to overflow, in which case the
+        // eventfd is readable anyway
+        ssize_t n = write(fd, &one, sizeof(one));
+        (void)n;
+    }
+    return 0;
+}
+
+/**
+ * Wakes `t` if it is parked, otherwise leaves it a permit so its next
+ * lwp_park returns right away
+ */
+static void thread_wake(thread t) {
+    if (t == NULL || thread_is_unused(t) || LWPTERMINATED(t->status)) {
+        return;
+    }
+    struct thread_cold_st *cold = thread_cold(t);
+    if (!cold->parked) {
+        cold->permit = true;
+        return;
+    }
+    cold->parked = false;
+    lwp_rt->parked_threads--;
+    // parked time is not ready time
+    cold->last_tsc = rdtsc();
+    sched_on_wake(sched_current(), t);
+}
+
+/**
+ * Delivers everything pushed onto the inbox so far: wakes threads and turns
+ * posts into tasks
+ */
+static void inbox_drain(void) {
+    if (!atomic_exchange_explicit(&lwp_rt->inbox_signaled, false,
+                                  memory_order_acq_rel)) {
+        return;
+    }
+    uint64_t count;
+    ssize_t n = read(atomic_load(&lwp_rt->inbox_fd), &count, sizeof(count));
+    (void)n;
+    while (true) {
+        struct inbox_node_st *next = atomic_load_explicit(
+            &lwp_rt->inbox_head->next, memory_order_acquire);
+        // also NULL while a producer is between swapping the tail and
+        // linking, that producer signals again once it has linked
+        if (next == NULL) {
+            break;
+        }
+        if (lwp_rt->inbox_head != &lwp_rt->inbox_stub) {
+            free(lwp_rt->inbox_head);
+        }
+        lwp_rt->inbox_head = next;
+        if (next->tid != NO_THREAD) {
+            thread_wake(tid2thread(next->tid));
+        } else {
+            lwp_spawn_task(next->fun, next->arg);
+        }
+    }
+}
+
+/**
+ * Sleeps until another OS thread pushes onto the inbox, then drains it
+ */
+static void inbox_wait(void) {
+    struct pollfd pfd = {.fd = inbox_fd(lwp_rt), .events = POLLIN};
+    if (pfd.fd == -1) {
+        exit(1);
+    }
+    while (!atomic_load(&lwp_rt->inbox_signaled)) {
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            fprintf(stderr, "lwp_yield: poll failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    inbox_drain();
+}
+
+/**
+ * Whether the running lwp_run_once / lwp_run_for should get control back
+ * instead of another thread being dispatched
+ */
+static inline bool host_should_return(void) {
+    return lwp_rt->stop_requested ||
+           lwp_rt->host_dispatches >= lwp_rt->host_budget ||
+           (lwp_rt->host_deadline != 0 && rdtsc() >= lwp_rt->host_deadline);
+}
+
+/**
+ * Switches from the host to `next`, returning once a thread switches back
+ * with host_return
+ */
+static void host_dispatch(thread next) {
+    uint64_t now = rdtsc();
+    struct thread_cold_st *next_cold = thread_cold(next);
+
+    lwp_rt->switches++;
+    lwp_rt->host_dispatches++;
+    next_cold->ready_cycles += now - next_cold->last_tsc;
+    next_cold->last_tsc = now;
+    lwp_rt->dispatch_tsc = now;
+    if (next_cold->admit_tsc != 0) {
+        thread_record_latency(now - next_cold->admit_tsc);
+        next_cold->admit_tsc = 0;
+    }
+    lwp_rt->cur_tid = next->tid;
+    if (lwp_rt->shared_stack != NULL &&
+        next_cold->stack == lwp_rt->shared_stack &&
+        next != lwp_rt->shared_owner) {
+        // the host is never on the shared stack so it can copy onto it
+        shared_stack_load(next);
+    }
+    swap_rfiles(&lwp_rt->host_state, &next_cold->state);
+}
+
+/**
+ * Switches from the running thread `cur` back to the host. `cur` stays
+ * admitted and continues from here the next time it is dispatched
+ */
+static void host_return(thread cur) {
+    uint64_t now = rdtsc();
+    struct thread_cold_st *cur_cold = thread_cold(cur);
+
+    cur_cold->switches++;
+    cur_cold->run_cycles += now - cur_cold->last_tsc;
+    sched_on_yield(cur, now - cur_cold->last_tsc);
+    cur_cold->last_tsc = now;
+    lwp_rt->cur_tid = NO_THREAD;
+    swap_rfiles(&cur_cold->state, &lwp_rt->host_state);
+}
+
+// FIXME: snakes demos are failing in snakes code
+// with a segmentation fault
+void lwp_yield(void) {
+    if (lwp_rt->in_task) {
+        fprintf(stderr, "lwp_yield: tasks can not yield\n");
+        return;
+    }
+    scheduler s = sched_current();
+    tid_t cur_tid = lwp_gettid();
     thread cur = tid2thread(cur_tid);
+    if (lwp_rt->zombies != NULL) {
+        thread_reap_stacks(cur);
+    }
+    if (atomic_load_explicit(&lwp_rt->inbox_signaled, memory_order_relaxed)) {
+        inbox_drain();
+    }
+    if (lwp_rt->tasks_len != 0) {
+        tasks_run_pending(cur);
+    }
+    if (lwp_rt->hosting && cur != NULL && host_should_return()) {
+        host_return(cur);
+        return;
+    }
+    thread next = sched_next(s);
+    while (next == NULL && !lwp_rt->hosting &&
+           (lwp_rt->tasks_len != 0 || lwp_rt->parked_threads != 0)) {
+        // nothing is runnable but tasks (which may wake threads) are
+        // pending, or everything left is parked and only another OS thread
+        // can wake it
+        if (lwp_rt->tasks_len == 0) {
+            lwp_rt->idle = true;
+            inbox_wait();
+            lwp_rt->idle = false;
+        }
+        if (lwp_rt->tasks_len != 0) {
+            tasks_run_pending(cur);
+        }
+        next = sched_next(s);
+    }
     if (next == NULL) {
+        if (lwp_rt->hosting && cur != NULL) {
+            host_return(cur);
+            return;
+        }
         int status = thread_get_status(cur);
         exit(status);
     }
@@ -340,19 +2142,454 @@ void lwp_yield(void) {
         exit(1);
     }
     if (cur->tid == next->tid) {
-        fprintf(stderr, "lwp_yield: next (%lu) is cur (%lu)\n", cur->tid, next->tid);
-        exit(1);
+        // e.g. cur is the only runnable thread, or parked and was woken
+        // before anything else became runnable. Still a yield as far as the
+        // scheduler's accounting goes
+        uint64_t now = rdtsc();
+        struct thread_cold_st *cur_cold = thread_cold(cur);
+        cur_cold->run_cycles += now - cur_cold->last_tsc;
+        sched_on_yield(cur, now - cur_cold->last_tsc);
+        cur_cold->last_tsc = now;
+        lwp_rt->dispatch_tsc = now;
+        return;
     }
     dbg("lwp_yield: switching from %lu to %lu\n", cur->tid, next->tid);
-    lwp_cur_tid = next->tid;
-    // save all current registers values to cur->state
-    // and load all register values from next->state
+    thread_account_switch(cur, next);
+    if (lwp_shm_region != NULL && lwp_shm_rt == lwp_rt) {
+        shm_stats_maybe_publish();
+    }
+    lwp_rt->cur_tid = next->tid;
+    lwp_rt->host_dispatches++;
+    struct thread_cold_st *next_cold = thread_cold(next);
+    if (lwp_rt->shared_stack != NULL &&
+        next_cold->stack == lwp_rt->shared_stack &&
+        next != lwp_rt->shared_owner) {
+        shared_stack_switch(cur, next);
+        return;
+    }
+    // save all current registers values to cur's state
+    // and load all register values from next's state
     // NOTE: must be last call as execution will continue where it left off
     // when yielding to a thread that previously yielded
-    swap_rfiles(&cur->state, &next->state);
+    swap_rfiles(&thread_cold(cur)->state, &next_cold->state);
+}
+
+static struct arena_chunk_st *arena_chunk_new(size_t size) {
+    struct arena_chunk_st *chunk;
+    if (size == ARENA_CHUNK_SIZE - ARENA_HEADER_SIZE &&
+        lwp_rt->arena_pool != NULL) {
+        chunk = lwp_rt->arena_pool;
+        lwp_rt->arena_pool = chunk->next;
+        lwp_rt->arena_pool_len--;
+        return chunk;
+    }
+    chunk = (struct arena_chunk_st *)aligned_alloc(ARENA_ALIGN,
+                                                   ARENA_HEADER_SIZE + size);
+    if (chunk != NULL) {
+        chunk->size = size;
+    }
+    return chunk;
+}
+
+/**
+ * Hands every chunk of the thread's arena back to the pool (or to free() if
+ * the pool is full or the chunk is oversized)
+ */
+static void arena_release(struct thread_cold_st *cold) {
+    struct arena_chunk_st *chunk = cold->arena;
+    while (chunk != NULL) {
+        struct arena_chunk_st *next = chunk->next;
+        if (chunk->size == ARENA_CHUNK_SIZE - ARENA_HEADER_SIZE &&
+            lwp_rt->arena_pool_len < ARENA_POOL_MAX) {
+            chunk->next = lwp_rt->arena_pool;
+            lwp_rt->arena_pool = chunk;
+            lwp_rt->arena_pool_len++;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    cold->arena = NULL;
+    cold->arena_next = NULL;
+    cold->arena_end = NULL;
+}
+
+void *lwp_alloc(size_t size) {
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    if (cur == NULL) {
+        fprintf(stderr, "lwp_alloc: not called from a thread\n");
+        return NULL;
+    }
+    struct thread_cold_st *cold = thread_cold(cur);
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if ((size_t)(cold->arena_end - cold->arena_next) >= size) {
+        void *ptr = cold->arena_next;
+        cold->arena_next += size;
+        return ptr;
+    }
+
+    size_t chunk_size = ARENA_CHUNK_SIZE - ARENA_HEADER_SIZE;
+    if (size > chunk_size) {
+        // give it a chunk of its own behind the current one so the rest of
+        // the current chunk can still be used
+        struct arena_chunk_st *big = arena_chunk_new(size);
+        if (big == NULL) {
+            return NULL;
+        }
+        if (cold->arena == NULL) {
+            big->next = NULL;
+            cold->arena = big;
+        } else {
+            big->next = cold->arena->next;
+            cold->arena->next = big;
+        }
+        return (char *)big + ARENA_HEADER_SIZE;
+    }
+    struct arena_chunk_st *chunk = arena_chunk_new(chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = cold->arena;
+    cold->arena = chunk;
+    cold->arena_next = (char *)chunk + ARENA_HEADER_SIZE + size;
+    cold->arena_end = (char *)chunk + ARENA_HEADER_SIZE + chunk_size;
+    return (char *)chunk + ARENA_HEADER_SIZE;
+}
+
+void lwp_arena_reset(void) {
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    if (cur == NULL) {
+        return;
+    }
+    arena_release(thread_cold(cur));
+}
+
+static inline lwp_key_t key_count(void) {
+    return atomic_load_explicit(&lwp_num_keys, memory_order_acquire);
+}
+
+int lwp_key_create(lwp_key_t *key, void (*dtor)(void *)) {
+    pthread_mutex_lock(&lwp_keys_lock);
+    lwp_key_t n = atomic_load_explicit(&lwp_num_keys, memory_order_relaxed);
+    if (n == LWP_KEYS_MAX) {
+        pthread_mutex_unlock(&lwp_keys_lock);
+        fprintf(stderr, "lwp_key_create: out of keys\n");
+        return -1;
+    }
+    lwp_key_dtors[n] = dtor;
+    atomic_store_explicit(&lwp_num_keys, n + 1, memory_order_release);
+    pthread_mutex_unlock(&lwp_keys_lock);
+    *key = n;
+    return 0;
+}
+
+void *lwp_getspecific(lwp_key_t key) {
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    if (cur == NULL || key >= key_count()) {
+        return NULL;
+    }
+    struct thread_cold_st *cold = thread_cold(cur);
+    if (key < LWP_KEYS_INLINE) {
+        return cold->specific[key];
+    }
+    key -= LWP_KEYS_INLINE;
+    if (key >= cold->specific_more_cap) {
+        return NULL;
+    }
+    return cold->specific_more[key];
+}
+
+int lwp_setspecific(lwp_key_t key, const void *value) {
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    if (cur == NULL) {
+        fprintf(stderr, "lwp_setspecific: not called from a thread\n");
+        return -1;
+    }
+    lwp_key_t num_keys = key_count();
+    if (key >= num_keys) {
+        fprintf(stderr, "lwp_setspecific: invalid key %u\n", key);
+        return -1;
+    }
+    struct thread_cold_st *cold = thread_cold(cur);
+    if (key < LWP_KEYS_INLINE) {
+        cold->specific[key] = (void *)value;
+        return 0;
+    }
+    key -= LWP_KEYS_INLINE;
+    if (key >= cold->specific_more_cap) {
+        // size for every key that exists now so this only happens once per
+        // thread unless more keys are created later
+        size_t new_cap = num_keys - LWP_KEYS_INLINE;
+        void **tmp = realloc(cold->specific_more, new_cap * sizeof(void *));
+        if (tmp == NULL) {
+            fprintf(stderr, "lwp_setspecific: failed to grow value table\n");
+            return -1;
+        }
+        memset(tmp + cold->specific_more_cap, 0,
+               (new_cap - cold->specific_more_cap) * sizeof(void *));
+        cold->specific_more = tmp;
+        cold->specific_more_cap = new_cap;
+    }
+    cold->specific_more[key] = (void *)value;
+    return 0;
+}
+
+/**
+ * Runs the destructors of the thread's non NULL key values, repeating while
+ * destructors set new values (up to LWP_KEY_DTOR_ITERATIONS times), then
+ * frees the overflow table
+ */
+static void thread_run_key_dtors(thread t) {
+    struct thread_cold_st *cold = thread_cold(t);
+    lwp_key_t num_keys = key_count();
+    int iter;
+    bool ran = true;
+
+    for (iter = 0; iter < LWP_KEY_DTOR_ITERATIONS && ran; iter++) {
+        lwp_key_t key;
+        ran = false;
+        for (key = 0; key < num_keys; key++) {
+            void **slot;
+            if (key < LWP_KEYS_INLINE) {
+                slot = &cold->specific[key];
+            } else if (key - LWP_KEYS_INLINE < cold->specific_more_cap) {
+                slot = &cold->specific_more[key - LWP_KEYS_INLINE];
+            } else {
+                break;
+            }
+            void *value = *slot;
+            if (value == NULL || lwp_key_dtors[key] == NULL) {
+                continue;
+            }
+            *slot = NULL;
+            lwp_key_dtors[key](value);
+            ran = true;
+        }
+    }
+    free(cold->specific_more);
+    cold->specific_more = NULL;
+    cold->specific_more_cap = 0;
+}
+
+static void future_add_waiter(lwp_future f, struct future_waiter_st *w) {
+    w->prev = NULL;
+    w->next = f->waiters;
+    if (f->waiters != NULL) {
+        f->waiters->prev = w;
+    }
+    f->waiters = w;
+}
+
+static void future_remove_waiter(lwp_future f, struct future_waiter_st *w) {
+    if (w->prev != NULL) {
+        w->prev->next = w->next;
+    } else {
+        f->waiters = w->next;
+    }
+    if (w->next != NULL) {
+        w->next->prev = w->prev;
+    }
+}
+
+/**
+ * Records the result of the exiting thread's future and wakes its waiters
+ */
+static void future_complete(lwp_future f, int result) {
+    struct future_waiter_st *w;
+
+    f->result = result;
+    f->done = true;
+    for (w = f->waiters; w != NULL; w = w->next) {
+        thread_wake(w->t);
+    }
+}
+
+lwp_future lwp_async(lwpfun fun, void *arg) {
+    lwp_future f = malloc(sizeof(*f));
+    if (f == NULL) {
+        fprintf(stderr, "lwp_async: failed to allocate future\n");
+        return NULL;
+    }
+    f->tid = thread_create(fun, arg, false);
+    if (f->tid == NO_THREAD) {
+        free(f);
+        return NULL;
+    }
+    f->done = false;
+    f->result = 0;
+    f->waiters = NULL;
+    thread_cold(tid2thread(f->tid))->future = f;
+    return f;
+}
+
+int lwp_await(lwp_future f, int *result) {
+    if (!f->done) {
+        thread cur = tid2thread(lwp_rt->cur_tid);
+        if (cur == NULL || lwp_rt->in_task) {
+            fprintf(stderr, "lwp_await: not called from a thread\n");
+            return -1;
+        }
+        struct future_waiter_st w = {.t = cur};
+        future_add_waiter(f, &w);
+        while (!f->done) {
+            lwp_park();
+        }
+        future_remove_waiter(f, &w);
+    }
+    if (result != NULL) {
+        *result = f->result;
+    }
+    return 0;
+}
+
+int lwp_await_all(lwp_future futures[], int n, int results[]) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (lwp_await(futures[i], results != NULL ? &results[i] : NULL) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* index of a completed future among the n or -1 */
+static int future_find_done(lwp_future futures[], int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (futures[i]->done) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int lwp_await_any(lwp_future futures[], int n, int *result) {
+    if (n < 1) {
+        return -1;
+    }
+    int done = future_find_done(futures, n);
+    if (done == -1) {
+        thread cur = tid2thread(lwp_rt->cur_tid);
+        if (cur == NULL || lwp_rt->in_task) {
+            fprintf(stderr, "lwp_await_any: not called from a thread\n");
+            return -1;
+        }
+        struct future_waiter_st *ws = malloc(n * sizeof(*ws));
+        if (ws == NULL) {
+            fprintf(stderr, "lwp_await_any: failed to allocate waiters\n");
+            return -1;
+        }
+        int i;
+        for (i = 0; i < n; i++) {
+            ws[i].t = cur;
+            future_add_waiter(futures[i], &ws[i]);
+        }
+        while ((done = future_find_done(futures, n)) == -1) {
+            lwp_park();
+        }
+        for (i = 0; i < n; i++) {
+            future_remove_waiter(futures[i], &ws[i]);
+        }
+        free(ws);
+    }
+    if (result != NULL) {
+        *result = futures[done]->result;
+    }
+    return done;
+}
+
+void lwp_future_free(lwp_future f) {
+    if (f == NULL) {
+        return;
+    }
+    if (!f->done) {
+        thread t = tid2thread(f->tid);
+        if (t != NULL) {
+            thread_cold(t)->future = NULL;
+        }
+    }
+    free(f);
+}
+
+static int parfor_task(void *arg);
+
+/**
+ * Splits off the upper halves of chunks [lo, hi) as tasks until a single
+ * chunk is left, then runs it
+ */
+static void parfor_run(struct parfor_st *pf, long lo, long hi) {
+    while (hi - lo > 1) {
+        long mid = lo + (hi - lo) / 2;
+        struct parfor_task_st *task = &pf->tasks[mid];
+        task->pf = pf;
+        task->lo = mid;
+        task->hi = hi;
+        if (lwp_spawn_task(parfor_task, task) == -1) {
+            // run the upper half here instead
+            parfor_run(pf, mid, hi);
+        }
+        hi = mid;
+    }
+    long b = pf->begin + lo * pf->grain;
+    long e = b + pf->grain < pf->end ? b + pf->grain : pf->end;
+    pf->body(b, e, pf->ctx);
+    if (--pf->pending == 0 && pf->waiter != NULL) {
+        thread_wake(pf->waiter);
+    }
+}
+
+static int parfor_task(void *arg) {
+    struct parfor_task_st *task = arg;
+    parfor_run(task->pf, task->lo, task->hi);
+    return 0;
+}
+
+int lwp_parallel_for(long begin, long end, long grain, lwp_range_fun body,
+                     void *ctx) {
+    if (grain < 1) {
+        fprintf(stderr, "lwp_parallel_for: grain must be positive\n");
+        return -1;
+    }
+    if (end <= begin) {
+        return 0;
+    }
+    long nchunks = (end - begin + grain - 1) / grain;
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    if (nchunks == 1 || cur == NULL || lwp_rt->in_task) {
+        // nothing to overlap with, or no thread to park
+        body(begin, end, ctx);
+        return 0;
+    }
+    struct parfor_st pf = {
+        .begin = begin,
+        .end = end,
+        .grain = grain,
+        .body = body,
+        .ctx = ctx,
+        .pending = nchunks,
+        .waiter = NULL,
+        .tasks = malloc(nchunks * sizeof(struct parfor_task_st)),
+    };
+    if (pf.tasks == NULL) {
+        body(begin, end, ctx);
+        return 0;
+    }
+    // run the first chunk here and leave the rest to the tasks
+    parfor_run(&pf, 0, nchunks);
+    pf.waiter = cur;
+    while (pf.pending != 0) {
+        lwp_park();
+    }
+    free(pf.tasks);
+    return 0;
 }
 
 void lwp_exit(thread_status_t status) {
+    if (lwp_rt->in_task) {
+        // it would terminate whichever thread is running the task queue
+        fprintf(stderr, "lwp_exit: tasks can not exit\n");
+        return;
+    }
     tid_t cur_tid = lwp_gettid();
     thread cur = tid2thread(cur_tid);
 
@@ -361,11 +2598,568 @@ void lwp_exit(thread_status_t status) {
         lwp_yield();
         return;
     }
+    // destructors may still want lwp_getspecific and lwp_alloc memory
+    thread_run_key_dtors(cur);
     thread_mark_terminated(cur, status);
+    sched_on_exit(sched_current(), cur);
+    if (thread_cold(cur)->future != NULL) {
+        future_complete(thread_cold(cur)->future, (int)status);
+    }
+    if (lwp_stack_watermarks) {
+        thread_sample_stack(cur);
+    }
+    if (thread_cold(cur)->shared) {
+        // the frames are on the shared stack now, the saved copy is stale
+        shared_stack_release(cur);
+    }
+    arena_release(thread_cold(cur));
+    struct thread_cold_st *cold = thread_cold(cur);
+    if (cold->stack != NULL && !cold->shared) {
+        // can't unmap the stack while still on it, the next switch does
+        cold->zombie_next = lwp_rt->zombies;
+        lwp_rt->zombies = cur;
+    }
+    admission_release();
+
+    lwp_yield();
+}
+
+/**
+ * Runs threads from the host until host_should_return, returning the number
+ * of times a thread was dispatched
+ */
+static int host_run(const char *caller, uint64_t budget, uint64_t deadline) {
+    if (lwp_rt->hosting || lwp_rt->cur_tid != NO_THREAD) {
+        fprintf(stderr, "%s: must be called from outside of the threads\n",
+                caller);
+        return -1;
+    }
+    scheduler s = lwp_get_scheduler();
+    lwp_rt->hosting = true;
+    lwp_rt->host_budget = budget;
+    lwp_rt->host_deadline = deadline;
+    lwp_rt->host_dispatches = 0;
+    // the threads switch among themselves until one of them switches back
+    // here, which happens early if it found nothing else to run
+    while (!host_should_return()) {
+        if (lwp_rt->zombies != NULL) {
+            thread_reap_stacks(NULL);
+        }
+        if (atomic_load_explicit(&lwp_rt->inbox_signaled,
+                                 memory_order_relaxed)) {
+            inbox_drain();
+        }
+        if (lwp_rt->tasks_len != 0) {
+            tasks_run_pending(NULL);
+        }
+        thread next = sched_next(s);
+        if (next == NULL) {
+            if (lwp_rt->tasks_len != 0) {
+                continue;
+            }
+            break;
+        }
+        host_dispatch(next);
+    }
+    lwp_rt->hosting = false;
+    lwp_rt->stop_requested = 0;
+    return (int)lwp_rt->host_dispatches;
+}
+
+int lwp_run_once(void) {
+    scheduler s = lwp_get_scheduler();
+    int qlen = sched_qlen(s);
+    if (qlen == 0) {
+        return 0;
+    }
+    return host_run("lwp_run_once", (uint64_t)qlen, 0);
+}
+
+int lwp_run_for(uint64_t ns) {
+    uint64_t cycles = (uint64_t)(ns * tsc_per_ns());
+    // a deadline of 0 means none, so never let it land there
+    return host_run("lwp_run_for", UINT64_MAX, rdtsc() + cycles + 1);
+}
+
+void lwp_set_quantum(uint64_t ns) {
+    lwp_quantum_cycles = (uint64_t)(ns * tsc_per_ns());
+    if (lwp_quantum_cycles == 0) {
+        lwp_quantum_cycles = 1;
+    }
+}
+
+void lwp_maybe_yield(void) {
+    if (rdtsc() - lwp_rt->dispatch_tsc < lwp_quantum_cycles) {
+        return;
+    }
+    if (lwp_quantum_cycles == 0) {
+        // calibrate on first use rather than making every program pay for it
+        lwp_set_quantum(DEFAULT_QUANTUM_NS);
+        if (rdtsc() - lwp_rt->dispatch_tsc < lwp_quantum_cycles) {
+            return;
+        }
+    }
+    // qlen counts the calling thread too. A lone thread still has to give
+    // the host back control once its budget or deadline is up
+    if (sched_qlen(sched_current()) > 1 ||
+        (lwp_rt->hosting && host_should_return())) {
+        lwp_yield();
+    }
+}
 
+void lwp_park(void) {
+    if (lwp_rt->in_task) {
+        fprintf(stderr, "lwp_park: tasks can not park\n");
+        return;
+    }
+    thread cur = tid2thread(lwp_rt->cur_tid);
+    if (cur == NULL) {
+        fprintf(stderr, "lwp_park: not called from a thread\n");
+        return;
+    }
+    struct thread_cold_st *cold = thread_cold(cur);
+    if (atomic_load_explicit(&lwp_rt->inbox_signaled, memory_order_relaxed)) {
+        // the wake-up may already be waiting in the inbox
+        inbox_drain();
+    }
+    if (cold->permit) {
+        cold->permit = false;
+        return;
+    }
+    cold->parked = true;
+    lwp_rt->parked_threads++;
+    sched_on_block(sched_current(), cur);
     lwp_yield();
 }
 
+int lwp_runtime_wake(lwp_runtime rt, tid_t tid) {
+    if (rt == NULL || tid == NO_THREAD) {
+        return -1;
+    }
+    return inbox_push(rt, tid, NULL, NULL);
+}
+
+int lwp_runtime_post(lwp_runtime rt, lwpfun fun, void *arg) {
+    if (rt == NULL || fun == NULL) {
+        return -1;
+    }
+    return inbox_push(rt, NO_THREAD, fun, arg);
+}
+
+int lwp_runtime_event_fd(lwp_runtime rt) {
+    if (rt == NULL) {
+        return -1;
+    }
+    return inbox_fd(rt);
+}
+
+int lwp_wake_external(tid_t tid) {
+    return lwp_runtime_wake(lwp_rt, tid);
+}
+
+int lwp_post(lwpfun fun, void *arg) {
+    return lwp_runtime_post(lwp_rt, fun, arg);
+}
+
+int lwp_event_fd(void) {
+    return inbox_fd(lwp_rt);
+}
+
+/**
+ * Appends the decimal digits of `v` to `buf` at `len`, returning the new
+ * length. Async-signal-safe, unlike snprintf
+ */
+static size_t watchdog_append_u64(char *buf, size_t len, uint64_t v) {
+    char digits[20];
+    int i = 0;
+    do {
+        digits[i++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    while (i > 0) {
+        buf[len++] = digits[--i];
+    }
+    return len;
+}
+
+static size_t watchdog_append_str(char *buf, size_t len, const char *str) {
+    while (*str != '\0') {
+        buf[len++] = *str++;
+    }
+    return len;
+}
+
+/**
+ * Runs on the OS thread running the threads, on top of the thread the
+ * watchdog caught, so the backtrace shows where it is stuck
+ */
+static void watchdog_handler(int sig) {
+    char buf[160];
+    void *frames[WATCHDOG_BACKTRACE_DEPTH];
+    tid_t tid = lwp_rt->cur_tid;
+    int saved_errno = errno;
+
+    if (tid != lwp_watchdog_tid ||
+        lwp_rt->dispatch_tsc != lwp_watchdog_dispatch) {
+        // it switched before the signal arrived
+        return;
+    }
+    thread t = tid2thread(tid);
+    if (t == NULL) {
+        return;
+    }
+    lwp_watchdog_events++;
+    void *entry = (void *)thread_cold(t)->entry;
+    uint64_t ran_us = lwp_watchdog_ran_us;
+    size_t len = watchdog_append_str(buf, 0, "lwp watchdog: thread ");
+    len = watchdog_append_u64(buf, len, tid);
+    len = watchdog_append_str(buf, len, " has run for ");
+    len = watchdog_append_u64(buf, len, ran_us / 1000);
+    len = watchdog_append_str(buf, len, ".");
+    len = watchdog_append_u64(buf, len, ran_us % 1000 / 100);
+    len = watchdog_append_str(buf, len, "ms without yielding");
+    if (lwp_rt->in_task) {
+        len = watchdog_append_str(buf, len, " (in a task)");
+    }
+    len = watchdog_append_str(buf, len, ", entry:\n");
+    ssize_t n = write(STDERR_FILENO, buf, len);
+    (void)n;
+    if (entry != NULL) {
+        backtrace_symbols_fd(&entry, 1, STDERR_FILENO);
+    } else {
+        n = write(STDERR_FILENO, "(original system thread)\n", 25);
+    }
+    int depth = backtrace(frames, WATCHDOG_BACKTRACE_DEPTH);
+    // skip this handler's frame
+    backtrace_symbols_fd(frames + 1, depth - 1, STDERR_FILENO);
+    errno = saved_errno;
+}
+
+static void *watchdog_main(void *arg) {
+    lwp_runtime rt = lwp_watchdog_rt;
+    uint64_t reported = 0;
+    struct timespec interval = {
+        .tv_sec = lwp_watchdog_interval_ns / 1000000000,
+        .tv_nsec = lwp_watchdog_interval_ns % 1000000000,
+    };
+
+    while (lwp_watchdog_running) {
+        nanosleep(&interval, NULL);
+        uint64_t dispatch =
+            __atomic_load_n(&rt->dispatch_tsc, __ATOMIC_RELAXED);
+        tid_t tid = __atomic_load_n(&rt->cur_tid, __ATOMIC_RELAXED);
+        if (tid == NO_THREAD || rt->idle || dispatch == 0 ||
+            dispatch == reported) {
+            continue;
+        }
+        if (rdtsc() - dispatch < lwp_watchdog_cycles) {
+            continue;
+        }
+        // report each dispatch at most once
+        reported = dispatch;
+        lwp_watchdog_tid = tid;
+        lwp_watchdog_dispatch = dispatch;
+        lwp_watchdog_ran_us =
+            (uint64_t)((rdtsc() - dispatch) / tsc_per_ns() / 1000);
+        pthread_kill(lwp_watchdog_target, LWP_WATCHDOG_SIGNAL);
+    }
+    return NULL;
+}
+
+int lwp_watchdog_start(uint64_t threshold_ns) {
+    if (lwp_watchdog_running) {
+        lwp_watchdog_stop();
+    }
+    if (threshold_ns == 0) {
+        return 0;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watchdog_handler;
+    // like SIGPROF, use the alternate stack in case the thread's growable
+    // stack has no room for the signal frame
+    action.sa_flags = SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(LWP_WATCHDOG_SIGNAL, &action, NULL) == -1) {
+        fprintf(stderr, "lwp_watchdog_start: sigaction failed: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    // backtrace loads libgcc the first time, do that here rather than in
+    // the signal handler
+    void *frame;
+    backtrace(&frame, 1);
+
+    lwp_watchdog_cycles = (uint64_t)(threshold_ns * tsc_per_ns());
+    lwp_watchdog_interval_ns = threshold_ns / 4;
+    if (lwp_watchdog_interval_ns < 1000 * 1000) {
+        lwp_watchdog_interval_ns = 1000 * 1000;
+    }
+    lwp_watchdog_target = pthread_self();
+    lwp_watchdog_rt = lwp_rt;
+    lwp_watchdog_running = true;
+    int err = pthread_create(&lwp_watchdog_thread, NULL, watchdog_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, "lwp_watchdog_start: pthread_create failed: %s\n",
+                strerror(err));
+        lwp_watchdog_running = false;
+        return -1;
+    }
+    return 0;
+}
+
+void lwp_watchdog_stop(void) {
+    if (!lwp_watchdog_running) {
+        return;
+    }
+    lwp_watchdog_running = false;
+    pthread_join(lwp_watchdog_thread, NULL);
+}
+
+static void profile_handler(int sig, siginfo_t *info, void *ucontext) {
+    ucontext_t *uc = ucontext;
+    uint64_t head = atomic_load_explicit(&lwp_profile_head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&lwp_profile_tail, memory_order_acquire);
+
+    if (head - tail >= lwp_profile_cap) {
+        lwp_profile_dropped++;
+        return;
+    }
+    struct profile_sample_st *sample =
+        &lwp_profile_samples[head % lwp_profile_cap];
+    thread t = tid2thread(lwp_rt->cur_tid);
+    sample->tid = lwp_rt->cur_tid;
+    sample->entry = t != NULL ? thread_cold(t)->entry : NULL;
+    sample->pcs[0] = uc->uc_mcontext.gregs[REG_RIP];
+    sample->depth = 1;
+
+    // only follow frame pointers that move up the stack the sample was taken
+    // on, anything else means a frame without one. The walk must stay on
+    // that stack: whatever lies past it may be another thread's guard page
+    // or growth region, and a fault there would land in stack_grow_handler
+    uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+    uintptr_t low = lwp_profile_host_low;
+    uintptr_t limit = lwp_profile_host_high;
+    if (t != NULL && thread_cold(t)->stack != NULL) {
+        low = (uintptr_t)thread_cold(t)->stack;
+        limit = low + thread_cold(t)->stacksize;
+    }
+    if (sp < low || sp >= limit) {
+        // e.g. mid switch, or on the switcher stack
+        limit = sp;
+    }
+    uintptr_t *fp = (uintptr_t *)uc->uc_mcontext.gregs[REG_RBP];
+    while (sample->depth < PROFILE_DEPTH && (uintptr_t)fp >= sp &&
+           (uintptr_t)fp + 2 * sizeof(uintptr_t) <= limit &&
+           ((uintptr_t)fp & 7) == 0) {
+        uintptr_t ret = fp[1];
+        if (ret == 0) {
+            break;
+        }
+        sample->pcs[sample->depth++] = ret;
+        if (fp[0] <= (uintptr_t)fp) {
+            break;
+        }
+        fp = (uintptr_t *)fp[0];
+    }
+    lwp_profile_taken++;
+    atomic_store_explicit(&lwp_profile_head, head + 1, memory_order_release);
+}
+
+int lwp_profile_start(unsigned int hz, size_t max_samples) {
+    if (lwp_profiling) {
+        lwp_profile_stop();
+    }
+    if (hz == 0 || max_samples == 0) {
+        fprintf(stderr, "lwp_profile_start: hz and max_samples must be "
+                        "positive\n");
+        return -1;
+    }
+    struct profile_sample_st *samples =
+        malloc(max_samples * sizeof(struct profile_sample_st));
+    if (samples == NULL) {
+        fprintf(stderr, "lwp_profile_start: failed to allocate samples\n");
+        return -1;
+    }
+    pthread_attr_t attr;
+    void *host_stack;
+    size_t host_stack_size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        fprintf(stderr, "lwp_profile_start: failed to find this OS thread's "
+                        "stack\n");
+        free(samples);
+        return -1;
+    }
+    pthread_attr_getstack(&attr, &host_stack, &host_stack_size);
+    pthread_attr_destroy(&attr);
+    lwp_profile_host_low = (uintptr_t)host_stack;
+    lwp_profile_host_high = (uintptr_t)host_stack + host_stack_size;
+    free(lwp_profile_samples);
+    lwp_profile_samples = samples;
+    lwp_profile_cap = max_samples;
+    atomic_store(&lwp_profile_head, 0);
+    atomic_store(&lwp_profile_tail, 0);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = profile_handler;
+    // a sample can land when a growable stack has no room for the signal
+    // frame, use the alternate stack if there is one
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) == -1) {
+        fprintf(stderr, "lwp_profile_start: sigaction failed: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    // only count CPU time of, and only interrupt, the calling OS thread
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event._sigev_un._tid = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &lwp_profile_timer) ==
+        -1) {
+        fprintf(stderr, "lwp_profile_start: timer_create failed: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    long period_ns = 1000000000L / hz;
+    struct itimerspec spec = {
+        .it_interval = {period_ns / 1000000000L, period_ns % 1000000000L},
+        .it_value = {period_ns / 1000000000L, period_ns % 1000000000L},
+    };
+    if (timer_settime(lwp_profile_timer, 0, &spec, NULL) == -1) {
+        fprintf(stderr, "lwp_profile_start: timer_settime failed: %s\n",
+                strerror(errno));
+        timer_delete(lwp_profile_timer);
+        return -1;
+    }
+    lwp_profiling = true;
+    return 0;
+}
+
+void lwp_profile_stop(void) {
+    if (!lwp_profiling) {
+        return;
+    }
+    timer_delete(lwp_profile_timer);
+    // a SIGPROF may still be pending, and its default action is to exit
+    signal(SIGPROF, SIG_IGN);
+    lwp_profiling = false;
+}
+
+/* writes the name of the function containing `pc` */
+static void profile_write_symbol(FILE *out, uintptr_t pc) {
+    Dl_info info;
+    if (dladdr((void *)pc, &info) != 0 && info.dli_sname != NULL) {
+        fputs(info.dli_sname, out);
+    } else if (info.dli_fname != NULL) {
+        const char *base = strrchr(info.dli_fname, '/');
+        fprintf(out, "%s+%#lx", base != NULL ? base + 1 : info.dli_fname,
+                pc - (uintptr_t)info.dli_fbase);
+    } else {
+        fprintf(out, "%#lx", pc);
+    }
+}
+
+static int profile_line_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Formats a sample as a folded stack without the count, or returns NULL if
+ * out of memory
+ */
+static char *profile_fold(const struct profile_sample_st *s, bool per_tid) {
+    char *line = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&line, &len);
+    if (out == NULL) {
+        return NULL;
+    }
+    if (s->tid == NO_THREAD) {
+        fputs("[host]", out);
+    } else if (s->entry == NULL) {
+        fputs("[lwp_start]", out);
+    } else {
+        fputc('[', out);
+        profile_write_symbol(out, (uintptr_t)s->entry);
+        fputc(']', out);
+    }
+    if (per_tid) {
+        fprintf(out, ";tid %lu", s->tid);
+    }
+    // outermost first. Return addresses point after the call, so look up
+    // the byte before them, except for the interrupted pc at index 0
+    uint32_t k;
+    for (k = s->depth; k > 0; k--) {
+        fputc(';', out);
+        profile_write_symbol(out, s->pcs[k - 1] - (k > 1 ? 1 : 0));
+    }
+    if (fclose(out) != 0) {
+        free(line);
+        return NULL;
+    }
+    return line;
+}
+
+int lwp_profile_write_folded(FILE *out, bool per_tid) {
+    uint64_t tail = atomic_load_explicit(&lwp_profile_tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&lwp_profile_head, memory_order_acquire);
+    uint64_t n = head - tail;
+    uint64_t i, j;
+    int ret = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+    char **lines = calloc(n, sizeof(char *));
+    if (lines == NULL) {
+        fprintf(stderr, "lwp_profile_write_folded: failed to allocate\n");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        lines[i] = profile_fold(&lwp_profile_samples[(tail + i) % lwp_profile_cap],
+                                per_tid);
+        if (lines[i] == NULL) {
+            fprintf(stderr, "lwp_profile_write_folded: failed to allocate\n");
+            ret = -1;
+            n = i;
+            break;
+        }
+    }
+    atomic_store_explicit(&lwp_profile_tail, tail + n, memory_order_release);
+
+    // samples with the same stack of functions end up next to each other
+    qsort(lines, n, sizeof(char *), profile_line_cmp);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && strcmp(lines[i], lines[j]) == 0; j++) {
+        }
+        fprintf(out, "%s %lu\n", lines[i], j - i);
+    }
+    for (i = 0; i < n; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    return ret;
+}
+
+void lwp_set_limits(unsigned long max_threads, size_t max_stack_bytes,
+                    int policy) {
+    lwp_rt->limit_threads = max_threads;
+    lwp_rt->limit_stack_bytes = max_stack_bytes;
+    lwp_rt->limit_policy = policy;
+    // the limits may have gone up
+    while (lwp_rt->admission_waiters != NULL && !admission_over(1, 0)) {
+        admission_release();
+    }
+}
+
+void lwp_stop(void) {
+    lwp_rt->stop_requested = 1;
+}
+
 tid_t lwp_wait(int *status) {
     if (status != NULL) {
         *status = 0;
@@ -374,46 +3168,348 @@ tid_t lwp_wait(int *status) {
 }
 
 tid_t lwp_gettid(void) {
-    return lwp_cur_tid;
+    return lwp_rt->cur_tid;
 }
 
 thread tid2thread(tid_t tid) {
-    if (lwp_threads == NULL) {
+    if (lwp_rt->threads == NULL) {
+        return NULL;
+    }
+    if (tid == NO_THREAD || tid >= lwp_rt->num_threads) {
+        return NULL;
+    }
+    return thread_at(tid);
+}
+
+/**
+ * Returns whether `t` is the slot of a thread that exists in the current
+ * runtime
+ */
+static bool thread_is_live(thread t) {
+    return t != NULL && !thread_is_unused(t) && tid2thread(t->tid) == t;
+}
+
+stack *lwp_thread_stack(thread t, size_t *size) {
+    if (!thread_is_live(t)) {
         return NULL;
     }
-    if (tid == NO_THREAD) {
+    struct thread_cold_st *cold = thread_cold(t);
+    if (size != NULL) {
+        *size = cold->stacksize;
+    }
+    return cold->stack;
+}
+
+rfile *lwp_thread_state(thread t) {
+    if (!thread_is_live(t)) {
         return NULL;
     }
-    return &lwp_threads[tid];
+    return &thread_cold(t)->state;
+}
+
+int lwp_stats(tid_t tid, struct lwp_stats_st *out) {
+    thread t = tid2thread(tid);
+    if (t == NULL || out == NULL || thread_is_unused(t)) {
+        return -1;
+    }
+    thread_fill_stats(t, out);
+    return 0;
+}
+
+void lwp_stats_all(lwp_stats_fun fun, void *arg) {
+    uint64_t i;
+    struct lwp_stats_st stats;
+
+    if (fun == NULL) {
+        return;
+    }
+    // i = 1 to skip the first `NO_THREAD` tid
+    for (i = 1; i < lwp_rt->num_threads; i++) {
+        thread t = thread_at(i);
+        if (thread_is_unused(t)) {
+            continue;
+        }
+        thread_fill_stats(t, &stats);
+        fun(&stats, arg);
+    }
+}
+
+int lwp_set_stack_growth(size_t initial, size_t max) {
+    size_t page = getpagesize();
+    if (initial == 0) {
+        lwp_stack_initial = 0;
+        lwp_stack_max = 0;
+        return 0;
+    }
+    if (max == 0) {
+        max = get_stack_size();
+    }
+    // round up to whole pages, keeping room for the guard
+    initial = (initial + page - 1) & ~(page - 1);
+    max = (max + page - 1) & ~(page - 1);
+    if (max < initial + STACK_GUARD_SIZE) {
+        max = initial + STACK_GUARD_SIZE;
+    }
+    if (stack_grow_install_handler() == -1) {
+        return -1;
+    }
+    lwp_stack_initial = initial;
+    lwp_stack_max = max;
+    return 0;
+}
+
+void lwp_set_stack_watermarks(bool enable) {
+    lwp_stack_watermarks = enable;
+}
+
+size_t lwp_stack_usage(tid_t tid) {
+    thread t = tid2thread(tid);
+    if (t == NULL || thread_is_unused(t)) {
+        return 0;
+    }
+    return thread_sample_stack(t);
+}
+
+void lwp_stack_usage_entries(lwp_stack_usage_fun fun, void *arg) {
+    uint64_t i;
+    if (fun == NULL) {
+        return;
+    }
+    for (i = 0; i < lwp_rt->stack_entries_cap; i++) {
+        struct stack_entry_usage_st *e = &lwp_rt->stack_entries[i];
+        if (e->entry != NULL) {
+            fun(e->entry, e->peak, e->samples, arg);
+        }
+    }
+}
+
+size_t lwp_trim_stacks(void) {
+    uint64_t i, j;
+    size_t page = getpagesize();
+    size_t released = 0;
+
+    // i = 1 to skip the first `NO_THREAD` tid
+    for (i = 1; i < lwp_rt->num_threads; i++) {
+        thread t = thread_at(i);
+        if (thread_is_unused(t) || t->tid == lwp_rt->cur_tid) {
+            continue;
+        }
+        struct thread_cold_st *cold = thread_cold(t);
+        if (cold->stack == NULL || cold->shared) {
+            continue;
+        }
+        // remember how deep the stack went before forgetting the pages
+        thread_sample_stack(t);
+
+        uintptr_t low = (uintptr_t)cold->stack;
+        uintptr_t end = low + cold->stacksize;
+        if (!LWPTERMINATED(t->status)) {
+            // a parked thread's frames all live above its saved %rsp, keep
+            // the page holding the red zone below it as well
+            uintptr_t rsp = cold->state.rsp;
+            if (rsp <= low || rsp > end) {
+                // has not run yet, only the shim frame at the top is in use
+                continue;
+            }
+            end = (rsp - 128) & ~(page - 1);
+        }
+        if (end <= low) {
+            continue;
+        }
+        unsigned char *vec = stack_mincore_vec(end - low);
+        if (vec != NULL && mincore((void *)low, end - low, vec) == 0) {
+            for (j = 0; j < (end - low) / page; j++) {
+                released += (vec[j] & 1) * page;
+            }
+        }
+        madvise((void *)low, end - low, MADV_DONTNEED);
+    }
+    return released;
 }
 
 struct scheduler_st default_scheduler(void) {
+#ifdef LWP_STATIC_SCHED
+    return SCHED_FN(scheduler);
+#else
     return rr_scheduler;
+#endif
+}
+
+/**
+ * Empties the scheduler's pool into a malloced array, storing its length in
+ * `n`. Returns NULL with `n` = 0 if the pool was empty, or NULL with `n` = -1
+ * if the array could not be allocated
+ */
+static thread *sched_drain(scheduler s, int *n) {
+    int cap = s->qlen();
+    int len = 0;
+    thread *threads = NULL;
+
+    *n = 0;
+    if (cap <= 0) {
+        return NULL;
+    }
+    threads = malloc(cap * sizeof(thread));
+    if (threads == NULL) {
+        *n = -1;
+        return NULL;
+    }
+    if (s->drain != NULL) {
+        int got;
+        while (len < cap && (got = s->drain(threads + len, cap - len)) > 0) {
+            len += got;
+        }
+    } else {
+        // qlen bounds the number of calls, not just the threads kept, in
+        // case remove leaves a (terminated) thread in the pool
+        int calls;
+        for (calls = 0; calls < cap; calls++) {
+            thread t = s->next();
+            if (t == NULL) {
+                break;
+            }
+            s->remove(t);
+            // pre v2 schedulers may still hold terminated threads
+            if (!LWPTERMINATED(t->status)) {
+                threads[len++] = t;
+            }
+        }
+    }
+    *n = len;
+    return threads;
 }
 
 void lwp_set_scheduler(scheduler s) {
-    scheduler cur = lwp_current_scheduler_ptr;
-    if (cur != NULL && cur->shutdown != NULL) {
-        cur->shutdown();
+    scheduler cur = lwp_rt->current_scheduler_ptr;
+    thread *threads = NULL;
+    int i, n = 0;
+
+#ifdef LWP_STATIC_SCHED
+    if (s != NULL && s->next != SCHED_FN(scheduler).next) {
+        fprintf(stderr, "lwp_set_scheduler: lwp was built with a static "
+                        "scheduler, keeping it\n");
+        return;
+    }
+#endif
+    if (cur != NULL) {
+        threads = sched_drain(cur, &n);
+        if (n == -1) {
+            fprintf(stderr, "lwp_set_scheduler: failed to allocate space to "
+                            "move threads, keeping the current scheduler\n");
+            return;
+        }
+        if (cur->shutdown != NULL) {
+            cur->shutdown();
+        }
     }
     if (s == NULL) {
-        lwp_current_scheduler = default_scheduler();
-        lwp_current_scheduler_ptr = &lwp_current_scheduler;
+        lwp_rt->current_scheduler = default_scheduler();
+        if (lwp_rt->current_scheduler.init != NULL) {
+            lwp_rt->current_scheduler.init();
+        }
+    } else {
+        if (s->init != NULL) {
+            s->init();
+        }
+        // copy in s so it can't be changed out from under us, only with `lwp_set_scheduler`
+        lwp_rt->current_scheduler = *s;
+    }
+    lwp_rt->current_scheduler_ptr = &lwp_rt->current_scheduler;
+    if (threads == NULL) {
+        return;
+    }
+
+    // hand the running thread over last so the others run before it again
+    thread running = tid2thread(lwp_rt->cur_tid);
+    for (i = 0; i < n - 1; i++) {
+        if (threads[i] == running) {
+            threads[i] = threads[n - 1];
+            threads[n - 1] = running;
+            break;
+        }
+    }
+    // admit_tsc is left alone, time spent migrating is still waiting time
+    sched_admit_batch(&lwp_rt->current_scheduler, threads, n);
+    free(threads);
+}
+
+void lwp_runtime_stats(struct lwp_runtime_stats_st *out) {
+    if (out == NULL) {
         return;
     }
-    if (s->init != NULL) {
-        s->init();
+    out->threads = lwp_rt->live_threads;
+    out->ready = lwp_get_scheduler()->qlen();
+    out->blocked = lwp_rt->parked_threads;
+    out->switches = lwp_rt->switches;
+    out->stack_bytes = lwp_rt->stack_bytes;
+    out->tasks_spawned = lwp_rt->tasks_spawned;
+    out->tasks_run = lwp_rt->tasks_run;
+    out->task_cycles = lwp_rt->task_cycles;
+    out->watchdog_events = lwp_watchdog_events;
+    out->profile_samples = lwp_profile_taken;
+    out->profile_dropped = lwp_profile_dropped;
+    out->creates_rejected = lwp_rt->creates_rejected;
+    out->creates_waited = lwp_rt->creates_waited;
+}
+
+int lwp_latency(scheduler s, struct lwp_latency_st *out, bool reset) {
+    struct lwp_hist *h = &lwp_rt->latency_hist;
+    if (s != NULL) {
+        h = s->latency;
+    }
+    if (h == NULL || out == NULL) {
+        return -1;
     }
-    // copy in s so it can't be changed out from under us, only with `lwp_set_scheduler`
-    lwp_current_scheduler = *s;
-    lwp_current_scheduler_ptr = &lwp_current_scheduler;
+    out->count = h->count;
+    out->p50 = lwp_hist_percentile(h, 0.5);
+    out->p99 = lwp_hist_percentile(h, 0.99);
+    out->p999 = lwp_hist_percentile(h, 0.999);
+    out->max = h->max;
+    if (reset) {
+        lwp_hist_reset(h);
+    }
+    return 0;
 }
 
 scheduler lwp_get_scheduler(void) {
-    if (lwp_current_scheduler_ptr == NULL) {
+    if (lwp_rt->current_scheduler_ptr == NULL) {
         // set scheduler to default if not already set before returning it
       lwp_set_scheduler(NULL);
-      assert(lwp_current_scheduler_ptr != NULL);
+      assert(lwp_rt->current_scheduler_ptr != NULL);
+    }
+    return lwp_rt->current_scheduler_ptr;
+}
+
+lwp_runtime lwp_runtime_new(void) {
+    lwp_runtime rt = malloc(sizeof(struct lwp_runtime_st));
+    if (rt == NULL) {
+        fprintf(stderr, "lwp_runtime_new: failed to allocate runtime\n");
+        return NULL;
+    }
+    *rt = (struct lwp_runtime_st)RUNTIME_INITIALIZER(*rt);
+    return rt;
+}
+
+int lwp_runtime_start_on_this_thread(lwp_runtime rt) {
+    if (rt == NULL) {
+        return -1;
     }
-    return lwp_current_scheduler_ptr;
+    if (lwp_rt->cur_tid != NO_THREAD || lwp_rt->hosting) {
+        fprintf(stderr, "lwp_runtime_start_on_this_thread: this OS thread is "
+                        "running threads of another runtime\n");
+        return -1;
+    }
+    if (rt->bound && !pthread_equal(rt->owner, pthread_self())) {
+        fprintf(stderr, "lwp_runtime_start_on_this_thread: runtime was "
+                        "started on another OS thread\n");
+        return -1;
+    }
+    rt->bound = true;
+    rt->owner = pthread_self();
+    lwp_rt = rt;
+    return 0;
+}
+
+lwp_runtime lwp_runtime_current(void) {
+    return lwp_rt;
 }
@@ -3,6 +3,8 @@
 #define LWPH
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 #if defined(_x86_64) || defined(__x86_64__) || defined(__amd64__) ||           \
@@ -46,11 +48,16 @@ typedef unsigned int thread_status_t;
 
 typedef unsigned long stack;
 
-struct threadinfo_st {
+/*
+ * What a scheduler sees of a thread, packed into one cache line. The stack and
+ * saved registers are kept separately by the library so schedulers walking
+ * their threads don't drag register files through the cache.
+ * This breaks code written against the original struct: the `stack`,
+ * `stacksize` and `state` fields are gone, use lwp_thread_stack() and
+ * lwp_thread_state() instead
+ */
+struct __attribute__((aligned(64))) threadinfo_st {
   tid_t tid;              /* lightweight process id */
-  stack* stack;           /* Base of allocated stack */
-  size_t stacksize;       /* Size of allocated stack */
-  rfile state;            /* saved registers */
   thread_status_t status; /* exited? exit status?  */
   thread lib_one;         /* Two pointers reserved */
   thread lib_two;         /* for use by the library */
@@ -63,6 +70,16 @@ typedef struct threadinfo_st* thread;
 
 typedef int (*lwpfun)(void *); /* type for lwp function */
 
+typedef unsigned int lwp_key_t; /* names a per thread value, see lwp_key_create */
+#define LWP_KEYS_MAX 1024 /* most keys lwp_key_create hands out */
+typedef struct lwp_future_st *lwp_future; /* result of lwp_async */
+typedef void (*lwp_range_fun)(long begin, long end, void *ctx);
+typedef struct lwp_group_st *lwp_group; /* see lwp_group_create */
+typedef struct lwp_runtime_st *lwp_runtime; /* see lwp_runtime_new */
+
+/* log-linear histogram of scheduling delays, see lwp_latency() */
+struct lwp_hist;
+
 /* Tuple that describes a scheduler */
 struct scheduler_st {
   void (*init)(void);            /* NULLABLE - initialize any structures */
@@ -71,9 +88,100 @@ struct scheduler_st {
   void (*remove)(thread victim); /* remove a thread from the pool */
   thread (*next)(void);          /* select a thread to schedule */
   int (*qlen)(void);             /* number of ready threads */
+  struct lwp_hist *latency;      /* NULLABLE - if set, admit-to-dispatch
+                                    delays are also recorded here */
+  void (*admit_batch)(thread *nts, int n); /* NULLABLE - add n threads to
+                                              the pool at once */
+  int version;                   /* LWP_SCHED_VERSION to opt in to the hooks
+                                    below, 0 for schedulers predating them */
+  void (*on_block)(thread t);    /* NULLABLE - t parked and is not runnable,
+                                    remove(t) is called if NULL */
+  void (*on_wake)(thread t);     /* NULLABLE - t woke up and is runnable
+                                    again, admit(t) is called if NULL */
+  void (*on_exit)(thread t);     /* NULLABLE - t terminated, remove(t) is
+                                    called if NULL */
+  void (*on_yield)(thread t, unsigned long long ran_cycles);
+                                 /* NULLABLE - t (not terminated) stopped
+                                    running after ran_cycles tsc cycles */
+  int (*drain)(thread *out, int max); /* NULLABLE - remove up to max threads
+                                         from the pool into out, returning
+                                         how many */
 };
 typedef struct scheduler_st* scheduler;
 
+/*
+ * Version of the scheduler interface. Schedulers with a lower `version` only
+ * have their threads removed when they park and are left to skip terminated
+ * threads themselves (LWPTERMINATED), and the on_* hooks are not called. At
+ * this version every thread in the pool is runnable
+ */
+#define LWP_SCHED_VERSION 2
+
+/* thread states reported by lwp_stats() */
+#define LWP_STATE_UNUSED 0
+#define LWP_STATE_READY 1
+#define LWP_STATE_RUNNING 2
+#define LWP_STATE_TERMINATED 3
+#define LWP_STATE_BLOCKED 4 /* parked in lwp_park() */
+
+/* Per-thread runtime statistics */
+struct lwp_stats_st {
+  tid_t tid;                       /* lightweight process id */
+  lwpfun entry;                    /* function given to lwp_create() or NULL
+                                      for the original system thread */
+  int state;                       /* one of LWP_STATE_* */
+  thread_status_t status;          /* the thread's status */
+  unsigned long switches;          /* voluntary switches (lwp_yield calls) */
+  unsigned long preemptions;       /* involuntary switches (always 0 as
+                                      threads are never preempted) */
+  unsigned long long run_cycles;   /* tsc cycles spent running */
+  unsigned long long ready_cycles; /* tsc cycles spent runnable but waiting */
+  unsigned long long created_ns;   /* CLOCK_MONOTONIC time of creation */
+};
+typedef void (*lwp_stats_fun)(const struct lwp_stats_st *, void *);
+
+/* Process wide runtime statistics, as reported by lwp_runtime_stats() */
+struct lwp_runtime_stats_st {
+  unsigned long threads;          /* threads that have not terminated */
+  unsigned long ready;            /* scheduler->qlen() */
+  unsigned long blocked;          /* threads parked in lwp_park() */
+  unsigned long long switches;    /* total context switches */
+  unsigned long long stack_bytes; /* bytes of stack mapped for threads */
+  unsigned long long tasks_spawned; /* calls to lwp_spawn_task() */
+  unsigned long long tasks_run;   /* tasks that have finished */
+  unsigned long long task_cycles; /* tsc cycles spent running tasks */
+  unsigned long long watchdog_events; /* threads reported by the watchdog */
+  unsigned long long profile_samples; /* samples taken by the profiler */
+  unsigned long long profile_dropped; /* samples lost to a full buffer */
+  unsigned long long creates_rejected; /* creations refused by lwp_set_limits */
+  unsigned long long creates_waited; /* creations that waited for capacity */
+};
+
+/* what lwp_create does when a limit set by lwp_set_limits would be exceeded */
+#define LWP_LIMIT_FAIL 0 /* return NO_THREAD with errno set to EAGAIN */
+#define LWP_LIMIT_WAIT 1 /* park the creating thread until there is room */
+
+/* Per group statistics, as reported by lwp_group_stats() */
+struct lwp_group_stats_st {
+  unsigned int weight;
+  unsigned long ready;            /* threads of the group in the pool */
+  unsigned long long switches;    /* times one of its threads stopped running */
+  unsigned long long run_cycles;  /* tsc cycles its threads ran */
+};
+
+/* called with an entry function, its deepest stack usage in bytes and the
+ * number of samples taken of threads running it */
+typedef void (*lwp_stack_usage_fun)(lwpfun, size_t, unsigned long, void *);
+
+/* Scheduling delay summary in tsc cycles, as reported by lwp_latency() */
+struct lwp_latency_st {
+  unsigned long long count; /* number of samples */
+  unsigned long long p50;
+  unsigned long long p99;
+  unsigned long long p999;
+  unsigned long long max;
+};
+
 /**
  * Creates a new thread and admits it to the current scheduler. The thread’s
  * resources will consist of a context and stack, both initialized so that when
@@ -81,6 +189,36 @@ typedef struct scheduler_st* scheduler;
  * it will run the given function. This may be called by any thread.
  */
 extern tid_t lwp_create(lwpfun, void *);
+/**
+ * Creates n threads running fun(args[i]) (or fun(NULL) if args is NULL) in one
+ * pass: the thread slots are found in one scan, the stacks come from a single
+ * mapping and the threads are handed to the scheduler's admit_batch() if it
+ * has one. If tids is non-NULL the new threads' ids are stored in it.
+ * Returns n, or -1 if the threads could not be created (none are)
+ */
+extern int lwp_create_many(lwpfun, void *args[], int n, tid_t tids[]);
+
+/**
+ * Like lwp_create(), but the thread runs on a stack shared with every other
+ * thread created this way. When another shared thread needs the stack, the
+ * live part of this thread's stack (from where it yielded up to the top) is
+ * copied out to a buffer sized to fit and copied back before it next runs,
+ * so an idle thread that yields from a shallow call depth costs a few hundred
+ * bytes instead of a whole stack. Pointers to a shared thread's locals are
+ * only valid while it is the one on the stack, so they must not be handed to
+ * other threads. If threads of the same function have been keeping deep
+ * stacks, the thread is given a private stack instead.
+ */
+extern tid_t lwp_create_shared(lwpfun, void *);
+
+/**
+ * Queues fun(arg) to run to completion as a stackless task: it gets no thread,
+ * context or stack of its own and is run on the stack of whichever thread
+ * next calls lwp_yield(), before the next thread is picked. Tasks must not
+ * call lwp_yield() or anything that does, and their return value is ignored.
+ * Returns 0 on success or -1 if the task could not be queued
+ */
+extern int lwp_spawn_task(lwpfun, void *);
 
 /**
  * Terminates the calling thread. Its termination status becomes the low 8 bits
@@ -89,15 +227,146 @@ extern tid_t lwp_create(lwpfun, void *);
  * lwp_yield().
  */
 extern void lwp_exit(thread_status_t);
+/**
+ * Allocates size bytes (16 byte aligned) from the calling thread's arena.
+ * There is no way to free a single allocation: everything the thread
+ * allocated is released at once by lwp_arena_reset() or when the thread
+ * exits. Returns NULL if the memory could not be allocated or if not called
+ * from a thread
+ */
+extern void *lwp_alloc(size_t);
+/**
+ * Releases everything the calling thread allocated with lwp_alloc()
+ */
+extern void lwp_arena_reset(void);
+/**
+ * Creates a key that every thread can associate its own value with, like
+ * pthread_key_create. Values start out NULL. When a thread exits, dtor (if
+ * not NULL) is called with the thread's value for the key if it is not NULL.
+ * Keys are shared by all runtimes and may be created from any OS thread, up
+ * to LWP_KEYS_MAX of them. Stores the key in `key` and returns 0, or returns
+ * -1 on failure
+ */
+extern int lwp_key_create(lwp_key_t *key, void (*dtor)(void *));
+/**
+ * Returns the calling thread's value for the key, or NULL if it was never set
+ */
+extern void *lwp_getspecific(lwp_key_t);
+/**
+ * Sets the calling thread's value for the key. Returns 0 on success or -1 if
+ * the key is invalid or not called from a thread
+ */
+extern int lwp_setspecific(lwp_key_t, const void *);
+/**
+ * Blocks the calling thread until it is woken by lwp_wake_external. Returns
+ * right away if a wake-up arrived since the thread last parked, so a wake-up
+ * that races with the thread deciding to park is not lost. That wake-up may
+ * be stale, so callers should recheck what they are waiting for
+ */
+extern void lwp_park(void);
+/**
+ * Wakes the thread with the given tid if it is parked, or makes its next
+ * lwp_park return right away if not. Safe to call from any OS thread; the
+ * wake-up is delivered the next time the threads switch. The thread is looked
+ * up in the calling OS thread's runtime, use lwp_runtime_wake for another
+ * one. Returns 0 on success or -1 on failure
+ */
+extern int lwp_wake_external(tid_t);
+/**
+ * Runs fun(arg) as a task (see lwp_spawn_task) the next time the threads of
+ * the calling OS thread's runtime switch. Safe to call from any OS thread,
+ * use lwp_runtime_post to post to another runtime. Returns 0 on success or -1
+ * on failure
+ */
+extern int lwp_post(lwpfun, void *);
+/**
+ * Returns an eventfd that becomes readable when wake-ups or posts from other
+ * OS threads are waiting to be delivered, for a host loop using lwp_run_for to
+ * poll on, or -1 if it could not be created
+ */
+extern int lwp_event_fd(void);
+/**
+ * Creates a runtime: a set of threads with its own scheduler, independent of
+ * every other runtime. Everything in this header works on the runtime of the
+ * calling OS thread, which is a default runtime until it calls
+ * lwp_runtime_start_on_this_thread. Runtimes are never freed. Returns NULL on
+ * failure
+ */
+extern lwp_runtime lwp_runtime_new(void);
+/**
+ * Makes the runtime the calling OS thread's, which it then runs with
+ * lwp_start or lwp_run_for as usual. A runtime can only be started on one OS
+ * thread, and the calling thread must not be running threads of its current
+ * runtime. Runtimes on different OS threads share nothing when switching, so
+ * one can be pinned to each core. Returns 0 on success or -1 on failure
+ */
+extern int lwp_runtime_start_on_this_thread(lwp_runtime);
+/**
+ * Returns the calling OS thread's runtime
+ */
+extern lwp_runtime lwp_runtime_current(void);
+/**
+ * Like lwp_wake_external and lwp_post, for the threads of the given runtime.
+ * Safe to call from any OS thread
+ */
+extern int lwp_runtime_wake(lwp_runtime, tid_t);
+extern int lwp_runtime_post(lwp_runtime, lwpfun, void *);
+/**
+ * Like lwp_event_fd, for the given runtime
+ */
+extern int lwp_runtime_event_fd(lwp_runtime);
+/**
+ * Creates a thread running fun(arg) and returns a future for its return
+ * value (the status it exits with), or NULL on failure
+ */
+extern lwp_future lwp_async(lwpfun, void *);
+/**
+ * Blocks the calling thread until the future's thread has exited and stores
+ * its return value in `result` if not NULL. Returns 0 on success or -1 if
+ * not called from a thread
+ */
+extern int lwp_await(lwp_future, int *result);
+/**
+ * Awaits each of the n futures, storing their results in `results` if not
+ * NULL. Returns 0 on success or -1 if not called from a thread
+ */
+extern int lwp_await_all(lwp_future futures[], int n, int results[]);
+/**
+ * Blocks the calling thread until at least one of the n futures has
+ * completed and returns the index of one that has, storing its result in
+ * `result` if not NULL. Returns -1 if not called from a thread or n < 1
+ */
+extern int lwp_await_any(lwp_future futures[], int n, int *result);
+/**
+ * Frees a future. If its thread is still running the result is discarded.
+ * No thread may be awaiting it
+ */
+extern void lwp_future_free(lwp_future);
+/**
+ * Calls body(b, e, ctx) over [begin, end) in chunks of at most `grain`
+ * indices and returns once every chunk is done. The range is split in half
+ * recursively into tasks (see lwp_spawn_task), which run whenever threads
+ * switch while the calling thread waits, so like a task body must not
+ * yield. Runs everything inline if not called from a thread. Returns 0 or -1
+ * if grain < 1
+ */
+extern int lwp_parallel_for(long begin, long end, long grain,
+                            lwp_range_fun body, void *ctx);
 /**
  * Returns the tid of the calling thread or NO_THREAD if not called from within
  * a LWP
  */
 extern tid_t lwp_gettid(void);
 /**
- * Yields control to the next thread as indicated by the scheduler. If there is
- * no next thread, calls exit(3) with the termination status of the calling
- * thread (see below).
+ * Yields control to the next thread as indicated by the scheduler, which may
+ * be the calling thread itself. The thread that called lwp_start is admitted
+ * like any other, so lwp_start returns once it is picked again.
+ * When threads are driven by lwp_run_once or lwp_run_for, control goes back
+ * to their caller once its budget is used up or nothing is runnable.
+ * Otherwise, if nothing is runnable but threads are parked or tasks are
+ * pending, the OS thread sleeps until there is work, and if there is nothing
+ * left at all, calls exit(3) with the termination status of the calling
+ * thread (see below). Tasks can not yield.
  */
 extern void lwp_yield(void);
 /**
@@ -108,8 +377,78 @@ extern void lwp_yield(void);
  * already has one.
  */
 extern void lwp_start(void);
-// NOTE: unused?
-// extern void lwp_stop(void);
+/**
+ * Yields if the calling thread has been running for longer than the quantum
+ * (see lwp_set_quantum) since it was last dispatched and another thread is
+ * ready, or, under lwp_run_once / lwp_run_for, the host's turn has come.
+ * Otherwise returns right away, so it is cheap enough to call in tight loops
+ */
+extern void lwp_maybe_yield(void);
+/**
+ * Sets the quantum used by lwp_maybe_yield, in nanoseconds. Defaults to 1ms
+ */
+extern void lwp_set_quantum(uint64_t ns);
+/**
+ * Runs each runnable thread about once and returns, for driving the threads
+ * from a host event loop instead of calling lwp_start. The caller is not a
+ * thread and gets control back when a thread yields or exits after the
+ * budget is used up, or when nothing is runnable. Returns the number of
+ * threads dispatched, 0 if none were runnable, or -1 if called from a thread
+ */
+extern int lwp_run_once(void);
+/**
+ * Like lwp_run_once but keeps dispatching threads until `ns` nanoseconds have
+ * passed. Threads only give control back when they yield, so a thread that
+ * does not yield can overrun the time slice
+ */
+extern int lwp_run_for(uint64_t ns);
+/**
+ * Starts a watchdog pthread that reports threads running for longer than
+ * threshold_ns without yielding: their tid, entry function and a backtrace
+ * are written to stderr (link with -rdynamic for function names) and counted
+ * in lwp_runtime_stats. Must be called from the OS thread running the
+ * threads, which gets SIGURG when there is something to report. A threshold
+ * of 0 stops the watchdog. Returns 0 on success or -1 on failure
+ */
+extern int lwp_watchdog_start(uint64_t threshold_ns);
+/**
+ * Stops the watchdog if it is running
+ */
+extern void lwp_watchdog_stop(void);
+/**
+ * Starts sampling the OS thread running the threads (the caller) hz times per
+ * second of CPU time with SIGPROF. Each sample records the tid, the entry
+ * function of the running thread and a frame pointer walk of its stack into
+ * a buffer of max_samples samples. Returns 0 on success or -1 on failure
+ */
+extern int lwp_profile_start(unsigned int hz, size_t max_samples);
+/**
+ * Stops sampling, the samples taken so far can still be written
+ */
+extern void lwp_profile_stop(void);
+/**
+ * Writes the samples taken since the last call as folded stacks (for
+ * flamegraph.pl), rooted at the thread's [entry function] and, if per_tid,
+ * its tid. Frames are only found through frame pointers, so build with
+ * -fno-omit-frame-pointer (and -rdynamic for function names). Returns 0 on
+ * success or -1 on failure
+ */
+extern int lwp_profile_write_folded(FILE *out, bool per_tid);
+/**
+ * Limits the number of live threads and the bytes of stack committed for
+ * them (see lwp_set_stack_growth), 0 for no limit. When creating a thread
+ * would go over a limit, lwp_create and friends either fail with errno set
+ * to EAGAIN or, under LWP_LIMIT_WAIT and when called from a thread, park it
+ * until enough threads have exited. Stacks of exited threads are unmapped at
+ * the next switch
+ */
+extern void lwp_set_limits(unsigned long max_threads, size_t max_stack_bytes,
+                           int policy);
+/**
+ * Makes the running lwp_run_once / lwp_run_for return at the next thread
+ * switch. Safe to call from a signal handler
+ */
+extern void lwp_stop(void);
 /**
  * Deallocates the resources of a terminated LWP. If no LWPs have terminated and
  * there still exist runnable threads, blocks until one terminates. If status is
@@ -121,18 +460,142 @@ extern void lwp_start(void);
 extern tid_t lwp_wait(int *);
 /**
  * Sets the scheduler to the one given,
- * reverting to round robin scheduling if the scheduler is NULL
+ * reverting to round robin scheduling if the scheduler is NULL.
+ * The threads in the old scheduler's pool (including the calling thread) are
+ * moved to the new one, through the old one's drain (or next and remove) and
+ * the new one's admit_batch (or admit)
  */
 extern void lwp_set_scheduler(scheduler);
 /**
  * Returns the current scheduler
  */
 extern scheduler lwp_get_scheduler(void);
+/**
+ * Returns the group scheduler. Once installed with lwp_set_scheduler, it
+ * splits the CPU between groups of threads in proportion to their weights,
+ * whatever the number of threads in each. Threads not added to a group are
+ * in a default group of weight 1
+ */
+extern scheduler lwp_group_scheduler(void);
+/**
+ * Creates a group with the given weight whose threads are picked by the
+ * `inner` scheduler, or round robin if NULL. Since scheduler functions take
+ * no context, `inner` must not be used by any other group or be installed
+ * itself. Returns NULL on failure
+ */
+extern lwp_group lwp_group_create(unsigned int weight, scheduler inner);
+/**
+ * Moves the thread with the given tid to the group (the default group if
+ * NULL). Returns 0 on success or -1 if the tid does not name a live thread
+ */
+extern int lwp_group_add(lwp_group, tid_t);
+/**
+ * Changes the weight of the group (the default group if NULL). Returns -1 if
+ * weight is 0
+ */
+extern int lwp_group_set_weight(lwp_group, unsigned int weight);
+/**
+ * Fills `out` with the statistics of the group (the default group if NULL).
+ * Returns 0 on success or -1 if out is NULL
+ */
+extern int lwp_group_stats(lwp_group, struct lwp_group_stats_st *out);
 /**
  * Returns the thread associated with the given tid, or NULL if the ID is
  * invalid
  */
 extern thread tid2thread(tid_t tid);
+/**
+ * Returns the base of the stack the given thread runs on and stores its size
+ * in bytes in `size` if it is not NULL. Threads made with lwp_create_shared
+ * report the shared stack. Returns NULL if `t` is not a live thread of the
+ * calling OS thread's runtime
+ */
+extern stack *lwp_thread_stack(thread t, size_t *size);
+/**
+ * Returns the given thread's saved registers, which are only current while it
+ * is not running, or NULL if `t` is not a live thread of the calling OS
+ * thread's runtime
+ */
+extern rfile *lwp_thread_state(thread t);
+
+/**
+ * Fills `out` with the runtime statistics of the thread with the given tid.
+ * Returns 0 on success or -1 if the tid does not name a thread
+ */
+extern int lwp_stats(tid_t, struct lwp_stats_st *);
+/**
+ * Calls the given function with the statistics of every thread (live or
+ * terminated) along with the passed argument
+ */
+extern void lwp_stats_all(lwp_stats_fun, void *);
+
+/**
+ * Fills `out` with process wide runtime statistics
+ */
+extern void lwp_runtime_stats(struct lwp_runtime_stats_st *);
+/**
+ * Publishes runtime statistics to the shared memory region /dev/shm/lwp.<pid>
+ * (see lwpstat.h) at most once every interval_ms milliseconds, updated as
+ * threads switch. An interval of 0 stops publishing and removes the region.
+ * Publishing can also be turned on by setting LWP_STATS_SHM=<interval_ms> in
+ * the environment before lwp_start(). Returns 0 on success or -1 if the region
+ * could not be created
+ */
+extern int lwp_stats_publish(unsigned int interval_ms);
+/**
+ * Makes threads created from now on start with only the top `initial` bytes of
+ * their stack accessible. When a thread runs past that, a SIGSEGV handler
+ * (running on an alternate signal stack) makes more of the stack accessible,
+ * up to `max` bytes (or the stack rlimit if 0). The bottom page is never made
+ * accessible, so running past `max` still crashes. An `initial` of 0 returns
+ * to fully mapped stacks. Applies to every runtime, whether started before or
+ * after the call; each OS thread sets up its alternate stack the first time it
+ * creates a growable stack. Returns 0 on success or -1 if the handler could
+ * not be installed
+ */
+extern int lwp_set_stack_growth(size_t initial, size_t max);
+/**
+ * If enabled, every thread's stack usage is sampled as it exits so
+ * lwp_stack_usage_entries() covers threads that are no longer around
+ */
+extern void lwp_set_stack_watermarks(bool);
+/**
+ * Returns the deepest the stack of the thread with the given tid has been
+ * seen to grow, in bytes, or 0 if the tid does not name a thread or the thread
+ * runs on the original system stack. Usage is measured by which stack pages
+ * are resident, so it is rounded up to whole pages
+ */
+extern size_t lwp_stack_usage(tid_t);
+/**
+ * Calls the given function with the deepest stack usage seen for each entry
+ * function passed to lwp_create() in the calling OS thread's runtime, along
+ * with the passed argument
+ */
+extern void lwp_stack_usage_entries(lwp_stack_usage_fun, void *);
+/**
+ * Returns the stack pages below the saved stack pointer of every thread that
+ * is not running (and all pages of terminated threads) to the kernel.
+ * The pages are zero filled on demand if the stack grows into them again.
+ * Returns the number of resident bytes released
+ */
+extern size_t lwp_trim_stacks(void);
+/**
+ * Allocates an empty histogram to use as a scheduler's `latency` field.
+ * Returns NULL if it can't be allocated
+ */
+extern struct lwp_hist *lwp_hist_new(void);
+/**
+ * Frees a histogram returned by lwp_hist_new()
+ */
+extern void lwp_hist_free(struct lwp_hist *);
+/**
+ * Summarizes the delay between a thread being admitted to the scheduler and it
+ * first being run. If the scheduler is NULL the global histogram (samples
+ * from every scheduler) is used, otherwise the scheduler's `latency`
+ * histogram. If reset is true the histogram is cleared after being read.
+ * Returns 0 on success or -1 if the scheduler has no histogram
+ */
+extern int lwp_latency(scheduler, struct lwp_latency_st *, bool reset);
 
 /* for lwp_wait */
 #define TERMOFFSET 8
@@ -0,0 +1,122 @@
+/*
+ * lwpstat: live top-like view of a process using the LWP library.
+ * The process must be publishing its stats, either by calling
+ * lwp_stats_publish() or by being started with LWP_STATS_SHM=<interval ms>
+ *
+ * usage: lwpstat [-i interval_ms] [-n iterations] pid
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwpstat.h"
+
+static const char *state_names[] = {"unused", "ready", "running", "term",
+                                     "blocked"};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-i interval_ms] [-n iterations] pid\n", prog);
+    exit(2);
+}
+
+/**
+ * Copies a consistent snapshot of the region into out, retrying while the
+ * writer is mid update
+ */
+static void region_read(const struct lwpstat_region *region,
+                        struct lwpstat_region *out) {
+    uint64_t before, after;
+    do {
+        before = __atomic_load_n(&region->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(out, (const void *)region, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&region->seq, __ATOMIC_RELAXED);
+        if (before == after) {
+            return;
+        }
+    } while (1);
+}
+
+static void region_print(const struct lwpstat_region *r) {
+    uint64_t i;
+
+    printf("\033[H\033[J");
+    printf("lwpstat - pid %ld\n", (long)r->pid);
+    printf("threads: %lu  ready: %lu  switches: %lu (%.0f/s)  stacks: %.1f MB\n\n",
+           r->threads, r->ready, r->switches, r->switches_per_sec,
+           r->stack_bytes / (double)(1 << 20));
+    printf("%10s %-8s %18s %6s %12s %16s\n", "TID", "STATE", "ENTRY", "%CPU",
+           "SWITCHES", "CYCLES");
+    for (i = 0; i < r->ntop && i < LWPSTAT_TOP_N; i++) {
+        const struct lwpstat_thread *t = &r->top[i];
+        double cpu = 0;
+        if (r->interval_cycles != 0) {
+            cpu = 100.0 * t->recent_cycles / r->interval_cycles;
+        }
+        const char *state = "?";
+        if (t->state < sizeof(state_names) / sizeof(state_names[0])) {
+            state = state_names[t->state];
+        }
+        printf("%10lu %-8s %#18lx %6.1f %12lu %16lu\n", t->tid, state, t->entry,
+               cpu, t->switches, t->run_cycles);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    long interval_ms = 1000;
+    long iterations = -1;
+    char name[64];
+    struct lwpstat_region snapshot;
+
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    snprintf(name, sizeof(name), LWPSTAT_NAME_FMT, atoi(argv[optind]));
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        perror(name);
+        return 1;
+    }
+    struct lwpstat_region *region =
+        mmap(NULL, sizeof(*region), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (region->magic != LWPSTAT_MAGIC || region->version != LWPSTAT_VERSION) {
+        fprintf(stderr, "%s: not an lwp stats region (or a different version)\n", name);
+        return 1;
+    }
+
+    struct timespec delay = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+    for (; iterations != 0; iterations--) {
+        region_read(region, &snapshot);
+        region_print(&snapshot);
+        nanosleep(&delay, NULL);
+    }
+    munmap(region, sizeof(*region));
+    return 0;
+}
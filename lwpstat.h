@@ -0,0 +1,46 @@
+// vim:filetype=c
+#ifndef LWPSTATH
+#define LWPSTATH
+
+#include <stdint.h>
+
+/*
+ * Layout of the stats region the LWP library publishes at
+ * /dev/shm/lwp.<pid> (see lwp_stats_publish()) and `lwpstat` reads.
+ *
+ * The region is guarded by a seqlock: the writer makes `seq` odd while it
+ * updates the fields and even again once done, readers copy the region and
+ * retry if `seq` was odd or changed while they were copying
+ */
+#define LWPSTAT_MAGIC 0x5350574c /* "LWPS" */
+#define LWPSTAT_VERSION 1
+#define LWPSTAT_NAME_FMT "/lwp.%d"
+#define LWPSTAT_TOP_N 16
+
+struct lwpstat_thread {
+  uint64_t tid;
+  uint64_t entry;        /* address of the function given to lwp_create */
+  uint64_t state;        /* one of LWP_STATE_* */
+  uint64_t switches;     /* total voluntary switches */
+  uint64_t run_cycles;   /* total tsc cycles spent running */
+  uint64_t recent_cycles; /* cycles spent running during the last interval */
+};
+
+struct lwpstat_region {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seq;             /* seqlock sequence number */
+  int64_t pid;
+  uint64_t updated_ns;      /* CLOCK_MONOTONIC time of the last update */
+  uint64_t interval_ns;     /* time covered by the rates below */
+  uint64_t interval_cycles; /* same interval in tsc cycles */
+  uint64_t threads;         /* live threads */
+  uint64_t ready;           /* scheduler->qlen() */
+  uint64_t switches;        /* total context switches */
+  double switches_per_sec;
+  uint64_t stack_bytes;     /* bytes of stack mapped for threads */
+  uint64_t ntop;            /* valid entries in top */
+  struct lwpstat_thread top[LWPSTAT_TOP_N]; /* by recent_cycles, descending */
+};
+
+#endif
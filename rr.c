@@ -8,159 +8,172 @@
 
 #include "lwp.h"
 
-#define RR_INITIAL_CAP 16
-#define RR_REALLOC_FACTOR 2
-
+#ifdef DEBUG
 #define dbg(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define dbg(...)
+#endif
 
-struct __rr_globals_st {
-    // the length of the threads array
+/*
+ * The ready threads form a ring linked through `sched_one` (next) and
+ * `sched_two` (prev). Since lwp removes threads from the pool when they
+ * block or exit (see LWP_SCHED_VERSION), everything in the ring is runnable
+ * and there is nothing to skip over
+ */
+#define rr_next_of(t) ((t)->sched_one)
+#define rr_prev_of(t) ((t)->sched_two)
+
+struct rr_ring_st {
+    // the number of threads in the ring
     uint64_t len;
-    // the capacity of the threads array
-    uint64_t cap;
-    // the current iteration index
-    uint64_t i;
-    // the threads array
-    thread* threads;
+    // the thread `rr_next` returns next, NULL if the ring is empty
+    thread ring;
+    // the thread `rr_next` returned last (the running thread), NULL if it
+    // has been removed since
+    thread last;
 };
 
-static struct __rr_globals_st __rr_globals = {.len= 0, .cap = 0, .threads = NULL};
+/*
+ * The ring operations take the ring so other schedulers (see group.c) can
+ * keep rings of their own, rr_scheduler uses `RR_RING`. lwp.c defines that to
+ * the current runtime's ring, otherwise there is one for the process
+ */
+#ifndef RR_RING
+static struct rr_ring_st __rr_globals = {.len = 0, .ring = NULL, .last = NULL};
+#define RR_RING (&__rr_globals)
+#endif
 
-void rr_shutdown(void) {
-    if (__rr_globals.threads == NULL) {
-        return;
+void rr_ring_clear(struct rr_ring_st *r) {
+    thread t = r->ring;
+    while (t != NULL) {
+        thread next = rr_next_of(t);
+        rr_next_of(t) = NULL;
+        rr_prev_of(t) = NULL;
+        t = next == r->ring ? NULL : next;
     }
-    free(__rr_globals.threads);
-    __rr_globals.threads = NULL;
+    r->ring = NULL;
+    r->last = NULL;
+    r->len = 0;
 }
 
-void rr_init(void) {
-    // TODO: ensure not already initialized?
-    __rr_globals.threads = (thread*)malloc(RR_INITIAL_CAP * sizeof(thread));
-    if (__rr_globals.threads == NULL) {
-        // TODO: handle error
+/**
+ * Links `new` in right before `pos`
+ */
+static void _rr_insert_before(thread pos, thread new) {
+    rr_next_of(new) = pos;
+    rr_prev_of(new) = rr_prev_of(pos);
+    rr_next_of(rr_prev_of(pos)) = new;
+    rr_prev_of(pos) = new;
+}
+
+void rr_ring_admit(struct rr_ring_st *r, thread new) {
+    r->len++;
+    if (r->ring == NULL) {
+        rr_next_of(new) = new;
+        rr_prev_of(new) = new;
+        r->ring = new;
+        return;
+    }
+    if (r->last == NULL) {
+        // the end of the round is right before the next thread to run
+        _rr_insert_before(r->ring, new);
         return;
     }
-    __rr_globals.cap = RR_INITIAL_CAP;
-    __rr_globals.len = 0;
+    // the running thread goes last in the round, `new` right before it
+    _rr_insert_before(r->last, new);
+    if (r->ring == r->last) {
+        r->ring = new;
+    }
 }
 
-void rr_admit(thread new) {
-
-    if (__rr_globals.threads == NULL) {
-        rr_init();
+void rr_ring_remove(struct rr_ring_st *r, thread victim) {
+    if (r->ring == NULL || rr_next_of(victim) == NULL) {
+        // not in the ring
+        return;
+    }
+    if (victim == r->last) {
+        r->last = NULL;
     }
-    // realloc if len == cap
-    if (__rr_globals.len >= __rr_globals.cap) {
-        __rr_globals.cap *= RR_REALLOC_FACTOR;
-        __rr_globals.threads = (thread*)realloc(__rr_globals.threads, __rr_globals.cap * sizeof(thread));
-        if (__rr_globals.threads == NULL) {
-            // TODO: handle error
-            return;
+    if (rr_next_of(victim) == victim) {
+        r->ring = NULL;
+    } else {
+        if (victim == r->ring) {
+            r->ring = rr_next_of(victim);
         }
+        rr_next_of(rr_prev_of(victim)) = rr_next_of(victim);
+        rr_prev_of(rr_next_of(victim)) = rr_prev_of(victim);
     }
-    __rr_globals.threads[__rr_globals.len] = new;
-    __rr_globals.len++;
+    rr_next_of(victim) = NULL;
+    rr_prev_of(victim) = NULL;
+    r->len--;
 }
 
-void _rr_remove_at(uint64_t i) {
-    uint64_t j;
-
-    // copy the threads over one by one... overwriting the one at index i
-    // NOTE: no free or anything, we don't assume we own the thread memory
-    for (j = i; j < __rr_globals.len - 1; j++) {
-        __rr_globals.threads[j] = __rr_globals.threads[j + 1];
-    }
-    // decrement the current iteration index if it is
-    // greater than the index of the removed thread
-    // so it stays pointed to the same next thread
-    if (i < __rr_globals.i) {
-        __rr_globals.i--;
+thread rr_ring_next(struct rr_ring_st *r) {
+    thread t = r->ring;
+    if (t == NULL) {
+        return NULL;
     }
-    // decrement the length of the threads array
-    __rr_globals.len--;
+    r->ring = rr_next_of(t);
+    r->last = t;
+    return t;
 }
 
-void rr_remove(thread victim) {
-    if (__rr_globals.threads == NULL) {
-        // TODO: handle error
-        return;
+int rr_ring_drain(struct rr_ring_st *r, thread *out, int max) {
+    int n = 0;
+    while (n < max && r->ring != NULL) {
+        out[n] = r->ring;
+        rr_ring_remove(r, out[n]);
+        n++;
     }
+    return n;
+}
 
-    uint64_t i;
+void rr_shutdown(void) {
+    rr_ring_clear(RR_RING);
+}
 
-    for (i = 0; i < __rr_globals.len; i++) {
-        if (__rr_globals.threads[i]->tid != victim->tid) {
-            continue;
-        }
-        _rr_remove_at(i);
-        break;
-    }
+void rr_init(void) {
+    rr_ring_clear(RR_RING);
+}
 
+void rr_admit(thread new) {
+    rr_ring_admit(RR_RING, new);
 }
 
-thread rr_next(void) {
-    if (__rr_globals.threads == NULL || __rr_globals.len == 0) {
-        return NULL;
+void rr_admit_batch(thread *new, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        rr_ring_admit(RR_RING, new[i]);
     }
+}
 
-    thread t = NULL;
-    uint64_t i = __rr_globals.i + 1;
-
-    // dbg("rr_next: i=%lu, len=%lu\n", i, __rr_globals.len);
-    for (; i < __rr_globals.len; i++) {
-        t = __rr_globals.threads[i];
-        if (t == NULL) {
-            // TODO: _rr_remove_at(t)?
-            continue;
-        }
-        if (LWPTERMINATED(t->status)) {
-            // TODO: _rr_remove_at(t)?
-            continue;
-        }
-        goto postamble;
-    }
-    for (i = 0; i < __rr_globals.i; i++) {
-        t = __rr_globals.threads[i];
-        if (t == NULL) {
-            // TODO: _rr_remove_at(t)?
-            continue;
-        }
-        if (LWPTERMINATED(t->status)) {
-            // TODO: _rr_remove_at(t)?
-             continue;
-        }
-        goto postamble;
-    }
+void rr_remove(thread victim) {
+    rr_ring_remove(RR_RING, victim);
+}
 
-    // BASE CASE: if the prev two for loops found an alive thread they would
-    // have jumped to the postamble, so if we reach this point we know that
-    // no alive threads were found
-    t = NULL;
+thread rr_next(void) {
+    return rr_ring_next(RR_RING);
+}
 
-postamble:
-    // dbg("rr_next: t=%p, i=%lu\n", t, i);
-    __rr_globals.i = i;
-    return t;
+int rr_drain(thread *out, int max) {
+    return rr_ring_drain(RR_RING, out, max);
 }
 
 int rr_qlen(void) {
-    // TODO: cache? will we be told when a thread is terminated?
-    uint64_t i;
-    int qlen = 0;
-
-    for (i = 0; i < __rr_globals.len; i++) {
-        if (__rr_globals.threads[i] == NULL) {
-            continue;
-        }
-        if (LWPTERMINATED(__rr_globals.threads[i]->status)) {
-            continue;
-        }
-        qlen++;
-    }
-    return qlen;
+    return (int)RR_RING->len;
 }
 
+/*
+ * For binding rr at compile time (see LWP_STATIC_SCHED in lwp.c): with no
+ * hooks of its own, blocked and exited threads are removed from the ring and
+ * woken ones admitted, which is what lwp does for it when picked at runtime
+ */
+#define rr_on_block rr_remove
+#define rr_on_wake rr_admit
+#define rr_on_exit rr_remove
+#define rr_HAS_ADMIT_BATCH 1
+#define rr_HAS_ON_YIELD 0
+
 struct scheduler_st rr_scheduler = {
     .init = rr_init,
     .shutdown = rr_shutdown,
@@ -168,6 +181,9 @@ struct scheduler_st rr_scheduler = {
     .remove = rr_remove,
     .next = rr_next,
     .qlen = rr_qlen,
+    .admit_batch = rr_admit_batch,
+    .version = LWP_SCHED_VERSION,
+    .drain = rr_drain,
 };
 
 #endif
@@ -0,0 +1,41 @@
+/*
+ * group_add: lwp_group_add only accepts tids of threads that exist.
+ * Exits with 1 if a bogus tid is accepted or a real one refused.
+ */
+
+#include <stdio.h>
+#include "lwp.h"
+
+static int check_thread_main(void *arg) {
+    (void)arg;
+    return 0;
+}
+
+int main(void) {
+    lwp_group g;
+    tid_t tid;
+    int failed = 0;
+
+    lwp_set_scheduler(lwp_group_scheduler());
+    g = lwp_group_create(1, NULL);
+    tid = lwp_create(check_thread_main, NULL);
+    if (g == NULL || tid == NO_THREAD) {
+        fprintf(stderr, "group_add: setup failed\n");
+        return 1;
+    }
+    if (lwp_group_add(g, tid) != 0) {
+        fprintf(stderr, "group_add: refused thread %lu\n", tid);
+        failed = 1;
+    }
+    // NO_THREAD, a slot past the last thread that was never handed out, and
+    // a tid past the thread table
+    if (lwp_group_add(g, NO_THREAD) != -1 ||
+        lwp_group_add(g, tid + 1) != -1 ||
+        lwp_group_add(g, tid + 1000000) != -1) {
+        fprintf(stderr, "group_add: accepted a bogus tid\n");
+        failed = 1;
+    }
+    lwp_start();
+    printf("group_add: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,86 @@
+/*
+ * growth_after_bind: a runtime started on an OS thread before
+ * lwp_set_stack_growth is called still gets stacks that grow. The worker
+ * binds its runtime, main then turns growth on, and the worker's threads
+ * (from lwp_create and lwp_create_many) recurse well past the initial
+ * commit. A missing alternate signal stack kills the process on the first
+ * fault.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include "lwp.h"
+
+#define CHECK_STACK_INITIAL (16 * 1024)
+#define CHECK_STACK_MAX (256 * 1024)
+#define CHECK_DEPTH 100     /* frames of about 1KB, ~100KB of stack */
+#define CHECK_MANY 8
+
+static atomic_int check_bound;
+static atomic_int check_growth_on;
+static atomic_int check_done;
+static int check_failed;
+
+static int check_recurse(int depth) {
+    volatile char frame[1024];
+    memset((void *)frame, depth, sizeof(frame));
+    if (depth == 0) {
+        return frame[0];
+    }
+    return check_recurse(depth - 1) + frame[depth];
+}
+
+static int check_thread_main(void *arg) {
+    (void)arg;
+    check_recurse(CHECK_DEPTH);
+    atomic_fetch_add(&check_done, 1);
+    return 0;
+}
+
+static void *check_worker(void *arg) {
+    lwp_runtime rt = arg;
+    void *args[CHECK_MANY] = {NULL};
+    tid_t tids[CHECK_MANY];
+
+    if (lwp_runtime_start_on_this_thread(rt) == -1) {
+        check_failed = 1;
+        return NULL;
+    }
+    atomic_store(&check_bound, 1);
+    while (!atomic_load(&check_growth_on)) {
+    }
+    if (lwp_create(check_thread_main, NULL) == NO_THREAD ||
+        lwp_create_many(check_thread_main, args, CHECK_MANY, tids) !=
+            CHECK_MANY) {
+        check_failed = 1;
+        return NULL;
+    }
+    while (lwp_run_for(1000000) > 0) {
+    }
+    return NULL;
+}
+
+int main(void) {
+    pthread_t worker;
+    lwp_runtime rt = lwp_runtime_new();
+
+    if (rt == NULL || pthread_create(&worker, NULL, check_worker, rt) != 0) {
+        fprintf(stderr, "growth_after_bind: setup failed\n");
+        return 1;
+    }
+    while (!atomic_load(&check_bound)) {
+    }
+    if (lwp_set_stack_growth(CHECK_STACK_INITIAL, CHECK_STACK_MAX) == -1) {
+        fprintf(stderr, "growth_after_bind: lwp_set_stack_growth failed\n");
+        return 1;
+    }
+    atomic_store(&check_growth_on, 1);
+    pthread_join(worker, NULL);
+    if (check_failed || atomic_load(&check_done) != CHECK_MANY + 1) {
+        check_failed = 1;
+    }
+    printf("growth_after_bind: %s\n", check_failed ? "FAILED" : "ok");
+    return check_failed;
+}